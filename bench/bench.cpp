@@ -0,0 +1,497 @@
+/*
+ * In-process benchmark harness for the LSM tree.
+ *
+ * Loads a tree with a number of records, then runs a YCSB-style mix of
+ * reads, writes, scans and deletes against it, drawing keys from a uniform,
+ * zipfian or sequential distribution. Both phases may be split over several
+ * client threads, to measure a sharded tree's scaling. Tree parameters accept comma-separated
+ * lists, and every combination is benchmarked in turn. Each combination
+ * prints one JSON object per line with its throughput and latency
+ * percentiles.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "histogram.h"
+#include "io.h"
+#include "sharded_tree.h"
+#include "sys.h"
+
+using namespace std;
+
+/*
+ * Key distributions
+ */
+
+// Draws record indexes in [0, n) from a zipfian distribution with the given
+// skew, using the method of Gray et al. as in YCSB. Ranks are scrambled with
+// a hash so that the popular records are spread over the key space.
+class ZipfianGenerator {
+    long n;
+    double theta, alpha, zetan, eta;
+public:
+    ZipfianGenerator(long n, double theta) : n(n), theta(theta) {
+        double zeta2;
+
+        zetan = 0;
+        for (long i = 1; i <= n; i++) {
+            zetan += 1 / pow((double)i, theta);
+        }
+
+        zeta2 = 1 + 1 / pow(2.0, theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    long next(mt19937_64& rng) const {
+        double u, uz;
+        long rank;
+        uint64_t hash;
+
+        u = uniform_real_distribution<double>(0, 1)(rng);
+        uz = u * zetan;
+
+        if (uz < 1) {
+            rank = 0;
+        } else if (uz < 1 + pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = (long)(n * pow(eta * u - eta + 1, alpha));
+        }
+
+        // FNV-1a over the rank's bytes
+        hash = 14695981039346656037ULL;
+        for (int i = 0; i < 8; i++) {
+            hash = (hash ^ ((rank >> (i * 8)) & 0xff)) * 1099511628211ULL;
+        }
+
+        return hash % n;
+    }
+};
+
+enum distribution {UNIFORM, ZIPFIAN, SEQUENTIAL};
+
+struct workload {
+    long records; // Records inserted during the load phase
+    long operations; // Operations run after the load phase
+    int read, write, scan, del; // Percentages of each operation in the mix
+    long max_scan_length; // Scans cover a uniform number of keys up to this
+    distribution dist;
+    double zipfian_theta;
+    unsigned seed;
+    int clients; // Threads issuing operations concurrently
+    long load_batch; // Records the load phase puts in each write batch
+};
+
+struct tree_config {
+    int buffer_num_pages, depth, fanout, num_threads, num_shards;
+    partitioning scheme;
+    float bf_bits_per_entry, rf_bits_per_entry;
+    filter_type filter;
+    long row_cache_entries;
+    buffer_mode buffer;
+};
+
+/*
+ * Benchmark
+ */
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void print_latency(ostream& out, const char *name, const Histogram& histogram) {
+    out << "\"" << name << "\":{\"count\":" << histogram.count()
+        << ",\"p50_us\":" << histogram.percentile(0.5) / 1000.0
+        << ",\"p99_us\":" << histogram.percentile(0.99) / 1000.0
+        << ",\"p999_us\":" << histogram.percentile(0.999) / 1000.0
+        << ",\"max_us\":" << histogram.max() / 1000.0 << "}";
+}
+
+// Runs one client's share of the operations, from its own random stream
+static void run_client(ShardedLSMTree& tree, const workload& w, int client, long operations,
+                       const ZipfianGenerator& zipfian, Histogram *latencies) {
+    vector<entry_t> scan_result;
+    mt19937_64 rng(w.seed + 1 + client);
+    uniform_int_distribution<long> uniform(0, w.records - 1);
+    uniform_int_distribution<long> scan_length(1, w.max_scan_length);
+    uniform_int_distribution<int> percent(0, 99);
+    long i, record, sequential_next;
+    int op, roll;
+    VAL_t val;
+
+    // Sequential clients each start at their own offset
+    sequential_next = w.records * client / w.clients;
+
+    for (i = 0; i < operations; i++) {
+        if (w.dist == ZIPFIAN) {
+            record = zipfian.next(rng);
+        } else if (w.dist == SEQUENTIAL) {
+            record = sequential_next++ % w.records;
+        } else {
+            record = uniform(rng);
+        }
+
+        roll = percent(rng);
+        if (roll < w.read) {
+            op = 0;
+        } else if (roll < w.read + w.write) {
+            op = 1;
+        } else if (roll < w.read + w.write + w.scan) {
+            op = 2;
+        } else {
+            op = 3;
+        }
+
+        auto op_start = latency_start();
+
+        switch (op) {
+        case 0:
+            tree.lookup(record, val);
+            break;
+        case 1:
+            tree.put(record, rng() & VAL_MAX);
+            break;
+        case 2:
+            scan_result.clear();
+            tree.scan(record, record + scan_length(rng), scan_result);
+            break;
+        case 3:
+            tree.del(record);
+            break;
+        }
+
+        latencies[op].record(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - op_start).count());
+    }
+}
+
+static void run_benchmark(const workload& w, const tree_config& c) {
+    Histogram latencies[4];
+    const char *names[4] = {"read", "write", "scan", "delete"};
+    vector<thread> clients;
+    vector<long> load_order;
+    mt19937_64 rng(w.seed);
+    long i, allocations;
+    double load_seconds, run_seconds;
+    int op;
+
+    ShardedLSMTree tree(c.num_shards, c.scheme,
+                        c.buffer_num_pages * getpagesize() / sizeof(entry_t),
+                        c.depth, c.fanout, c.num_threads, c.bf_bits_per_entry,
+                        c.rf_bits_per_entry, c.filter);
+    tree.set_row_cache(c.row_cache_entries);
+    tree.set_buffer_mode(c.buffer);
+
+    // Records are keyed by their index. The sequential distribution loads
+    // them in order; the others load them in a random order.
+    load_order.resize(w.records);
+    for (i = 0; i < w.records; i++) {
+        load_order[i] = i;
+    }
+    if (w.dist != SEQUENTIAL) {
+        shuffle(load_order.begin(), load_order.end(), rng);
+    }
+
+    // Load phase, with each client inserting an interleaved share of the
+    // records
+    auto start = chrono::steady_clock::now();
+
+    for (int client = 0; client < w.clients; client++) {
+        clients.emplace_back([&, client] {
+            mt19937_64 client_rng(w.seed + 1 + client);
+            WriteBatch batch;
+
+            for (long j = client; j < w.records; j += w.clients) {
+                if (w.load_batch <= 1) {
+                    tree.put(load_order[j], client_rng() & VAL_MAX);
+                    continue;
+                }
+
+                batch.put(load_order[j], client_rng() & VAL_MAX);
+
+                if (batch.size() == w.load_batch) {
+                    tree.write(batch);
+                    batch.clear();
+                }
+            }
+
+            tree.write(batch);
+        });
+    }
+
+    for (auto& client : clients) {
+        client.join();
+    }
+
+    load_seconds = seconds_since(start);
+
+    // Run phase
+    ZipfianGenerator zipfian(w.dist == ZIPFIAN ? w.records : 1, w.zipfian_theta);
+
+    clients.clear();
+    allocations = allocation_count();
+    start = chrono::steady_clock::now();
+
+    for (int client = 0; client < w.clients; client++) {
+        clients.emplace_back(run_client, ref(tree), cref(w), client,
+                             w.operations / w.clients + (client < w.operations % w.clients),
+                             cref(zipfian), latencies);
+    }
+
+    for (auto& client : clients) {
+        client.join();
+    }
+
+    run_seconds = seconds_since(start);
+    allocations = allocation_count() - allocations;
+
+    cout << "{\"config\":{\"buffer_pages\":" << c.buffer_num_pages
+         << ",\"depth\":" << c.depth
+         << ",\"fanout\":" << c.fanout
+         << ",\"threads\":" << c.num_threads
+         << ",\"shards\":" << c.num_shards
+         << ",\"partitioning\":\"" << (c.scheme == PARTITION_RANGE ? "range" : "hash") << "\""
+         << ",\"clients\":" << w.clients
+         << ",\"bf_bits_per_entry\":" << c.bf_bits_per_entry
+         << ",\"rf_bits_per_entry\":" << c.rf_bits_per_entry
+         << ",\"filter\":\"" << (c.filter == FILTER_XOR ? "xor" : "bloom") << "\""
+         << ",\"row_cache_entries\":" << c.row_cache_entries
+         << ",\"buffer\":\"" << (c.buffer == BUFFER_APPEND ? "append" : "sorted") << "\""
+         << ",\"io_backend\":\"" << io_queue().name() << "\"}"
+         << ",\"load\":{\"records\":" << w.records
+         << ",\"batch\":" << w.load_batch
+         << ",\"seconds\":" << load_seconds
+         << ",\"ops_per_sec\":" << w.records / load_seconds << "}"
+         << ",\"run\":{\"operations\":" << w.operations
+         << ",\"seconds\":" << run_seconds
+         << ",\"ops_per_sec\":" << w.operations / run_seconds
+         << ",\"allocations_per_op\":" << (double)allocations / max(w.operations, 1L)
+         << ",\"latency\":{";
+
+    for (op = 0; op < 4; op++) {
+        if (op > 0) cout << ",";
+        print_latency(cout, names[op], latencies[op]);
+    }
+
+    cout << "}}}" << endl;
+}
+
+/*
+ * Command line
+ */
+
+// Parses a comma-separated list of numbers
+template <typename T>
+static vector<T> parse_list(const char *arg) {
+    stringstream stream(arg);
+    string item;
+    vector<T> values;
+
+    while (getline(stream, item, ',')) {
+        values.push_back((T)atof(item.c_str()));
+    }
+
+    if (values.empty()) {
+        die("Empty list '" + string(arg) + "'.");
+    }
+
+    return values;
+}
+
+// Parses a comma-separated list of names
+static vector<string> parse_names(const char *arg) {
+    stringstream stream(arg);
+    string item;
+    vector<string> names;
+
+    while (getline(stream, item, ',')) {
+        names.push_back(item);
+    }
+
+    return names;
+}
+
+// Replaces each configuration with one copy per value of the given field,
+// so that every combination of the listed values is benchmarked
+template <typename T>
+static void expand(vector<tree_config>& configs, const vector<T>& values, T tree_config::*field) {
+    vector<tree_config> expanded;
+
+    for (const auto& config : configs) {
+        for (const T& value : values) {
+            expanded.push_back(config);
+            expanded.back().*field = value;
+        }
+    }
+
+    configs.swap(expanded);
+}
+
+// Sets the operation mix from a YCSB core workload letter
+static void set_preset(workload& w, char preset) {
+    w.read = w.write = w.scan = w.del = 0;
+
+    switch (preset) {
+    case 'a': w.read = 50; w.write = 50; break; // Update heavy
+    case 'b': w.read = 95; w.write = 5; break; // Read mostly
+    case 'c': w.read = 100; break; // Read only
+    case 'e': w.scan = 95; w.write = 5; break; // Short ranges
+    case 'w': w.write = 100; break; // Write only
+    default: die("Unknown workload preset '" + string(1, preset) + "'.");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    vector<int> buffer_num_pages, depths, fanouts, thread_counts, shard_counts;
+    vector<partitioning> schemes;
+    vector<float> bf_bits_per_entry, rf_bits_per_entry;
+    vector<filter_type> filters;
+    vector<long> row_cache_entries;
+    vector<buffer_mode> buffer_modes;
+    vector<int> mix;
+    workload w;
+    vector<tree_config> configs;
+    tree_config c;
+    string dist;
+    int opt;
+
+    buffer_num_pages = {2};
+    depths = {DEFAULT_TREE_DEPTH};
+    fanouts = {DEFAULT_TREE_FANOUT};
+    thread_counts = {DEFAULT_THREAD_COUNT};
+    shard_counts = {DEFAULT_SHARD_COUNT};
+    schemes = {PARTITION_HASH};
+    bf_bits_per_entry = {DEFAULT_BF_BITS_PER_ENTRY};
+    rf_bits_per_entry = {DEFAULT_RF_BITS_PER_ENTRY};
+    filters = {FILTER_BLOOM};
+    row_cache_entries = {DEFAULT_ROW_CACHE_ENTRIES};
+    buffer_modes = {BUFFER_SORTED};
+
+    w.records = 100000;
+    w.operations = 100000;
+    w.max_scan_length = 100;
+    w.dist = ZIPFIAN;
+    w.zipfian_theta = 0.99;
+    w.seed = 1;
+    w.clients = 1;
+    w.load_batch = 1;
+    set_preset(w, 'a');
+
+    while ((opt = getopt(argc, argv, "b:B:d:f:t:N:P:r:R:F:C:i:n:o:c:u:w:m:k:z:s:S:")) != -1) {
+        switch (opt) {
+        case 'b': buffer_num_pages = parse_list<int>(optarg); break;
+        case 'B':
+            buffer_modes.clear();
+            for (const string& name : parse_names(optarg)) {
+                buffer_modes.push_back(parse_buffer_mode(name));
+            }
+            break;
+        case 'd': depths = parse_list<int>(optarg); break;
+        case 'f': fanouts = parse_list<int>(optarg); break;
+        case 't': thread_counts = parse_list<int>(optarg); break;
+        case 'N': shard_counts = parse_list<int>(optarg); break;
+        case 'P':
+            schemes.clear();
+            for (const string& name : parse_names(optarg)) {
+                schemes.push_back(parse_partitioning(name));
+            }
+            break;
+        case 'r': bf_bits_per_entry = parse_list<float>(optarg); break;
+        case 'R': rf_bits_per_entry = parse_list<float>(optarg); break;
+        case 'F':
+            filters.clear();
+            for (const string& name : parse_names(optarg)) {
+                filters.push_back(parse_filter_type(name));
+            }
+            break;
+        case 'C': row_cache_entries = parse_list<long>(optarg); break;
+        case 'i': set_io_backend(optarg); break;
+        case 'n': w.records = atol(optarg); break;
+        case 'o': w.operations = atol(optarg); break;
+        case 'c': w.clients = atoi(optarg); break;
+        case 'u': w.load_batch = atol(optarg); break;
+        case 'w': set_preset(w, optarg[0]); break;
+        case 'm':
+            mix = parse_list<int>(optarg);
+            if (mix.size() != 4 || mix[0] + mix[1] + mix[2] + mix[3] != 100) {
+                die("The mix must be four percentages adding up to 100.");
+            }
+            w.read = mix[0]; w.write = mix[1]; w.scan = mix[2]; w.del = mix[3];
+            break;
+        case 'k':
+            dist = optarg;
+            if (dist == "uniform") w.dist = UNIFORM;
+            else if (dist == "zipfian") w.dist = ZIPFIAN;
+            else if (dist == "sequential") w.dist = SEQUENTIAL;
+            else die("Unknown key distribution '" + dist + "'.");
+            break;
+        case 'z': w.zipfian_theta = atof(optarg); break;
+        case 's': w.max_scan_length = atol(optarg); break;
+        case 'S': w.seed = atoi(optarg); break;
+        default:
+            die("Usage: " + string(argv[0]) + " "
+                "[-b buffer pages,...] "
+                "[-B sorted|append,...] "
+                "[-d initial levels,...] "
+                "[-f fanouts,...] "
+                "[-t threads,...] "
+                "[-N shards,...] "
+                "[-P hash|range,...] "
+                "[-r bloom filter bits per entry,...] "
+                "[-R range filter bits per entry,...] "
+                "[-F bloom|xor,...] "
+                "[-C row cache entries,...] "
+                "[-i I/O backend] "
+                "[-n records] "
+                "[-o operations] "
+                "[-c client threads] "
+                "[-u records per load phase write batch] "
+                "[-w YCSB preset: a, b, c, e or w] "
+                "[-m read,write,scan,delete percentages] "
+                "[-k uniform|zipfian|sequential] "
+                "[-z zipfian theta] "
+                "[-s max scan length] "
+                "[-S seed]");
+        }
+    }
+
+    if (w.records < 1) {
+        die("At least one record is needed.");
+    }
+
+    if (w.clients < 1) {
+        die("At least one client is needed.");
+    }
+
+    configs = {c};
+    expand(configs, buffer_num_pages, &tree_config::buffer_num_pages);
+    expand(configs, depths, &tree_config::depth);
+    expand(configs, fanouts, &tree_config::fanout);
+    expand(configs, thread_counts, &tree_config::num_threads);
+    expand(configs, shard_counts, &tree_config::num_shards);
+    expand(configs, schemes, &tree_config::scheme);
+    expand(configs, bf_bits_per_entry, &tree_config::bf_bits_per_entry);
+    expand(configs, rf_bits_per_entry, &tree_config::rf_bits_per_entry);
+    expand(configs, filters, &tree_config::filter);
+    expand(configs, row_cache_entries, &tree_config::row_cache_entries);
+    expand(configs, buffer_modes, &tree_config::buffer);
+
+    for (const auto& config : configs) {
+        run_benchmark(w, config);
+    }
+
+    return 0;
+}
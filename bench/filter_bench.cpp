@@ -0,0 +1,148 @@
+/*
+ * Benchmark of the point lookup filters runs can be built with.
+ *
+ * Builds an XOR filter and Bloom filters over a set of distinct random keys,
+ * then probes each with keys from the set and with keys outside it. The
+ * Bloom filters are sized both to the XOR filter's memory and to the number
+ * of bits per entry at which their expected false positive rate matches the
+ * XOR filter's. Each filter prints one JSON object per line with its
+ * construction time, probe times, memory and measured false positive rate.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#include "bloom_filter.h"
+#include "sys.h"
+#include "xor_filter.h"
+
+using namespace std;
+
+// Number of probe keys drawn from outside the key set
+#define NEGATIVE_PROBES 1000000
+
+static double nanos_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+// Probes a filter with every key, returning the number reported as set and
+// the mean time per probe in nanoseconds
+template <typename Filter>
+static long probe(const Filter& filter, const vector<KEY_t>& keys, double& nanos_per_probe) {
+    long found = 0;
+
+    auto start = chrono::steady_clock::now();
+
+    for (KEY_t key : keys) {
+        found += filter.is_set(key);
+    }
+
+    nanos_per_probe = nanos_since(start) / keys.size();
+    return found;
+}
+
+static void print_result(const char *name, double bits_per_key, double build_nanos,
+                         double hit_nanos, double miss_nanos, long false_positives) {
+    cout << "{\"filter\":\"" << name << "\""
+         << ",\"bits_per_key\":" << bits_per_key
+         << ",\"build_ns_per_key\":" << build_nanos
+         << ",\"positive_probe_ns\":" << hit_nanos
+         << ",\"negative_probe_ns\":" << miss_nanos
+         << ",\"false_positive_rate\":" << (double)false_positives / NEGATIVE_PROBES
+         << "}" << endl;
+}
+
+static void bench_bloom(const char *name, const vector<KEY_t>& keys,
+                        const vector<KEY_t>& negatives, double bits_per_key) {
+    double build_nanos, hit_nanos, miss_nanos;
+    long false_positives;
+
+    auto start = chrono::steady_clock::now();
+
+    BloomFilter filter(keys.size() * bits_per_key);
+    for (KEY_t key : keys) {
+        filter.set(key);
+    }
+
+    build_nanos = nanos_since(start) / keys.size();
+
+    if (probe(filter, keys, hit_nanos) != keys.size()) {
+        die("Bloom filter missed a key.");
+    }
+
+    false_positives = probe(filter, negatives, miss_nanos);
+    print_result(name, bits_per_key, build_nanos, hit_nanos, miss_nanos, false_positives);
+}
+
+int main(int argc, char *argv[]) {
+    unordered_set<KEY_t> key_set;
+    vector<KEY_t> keys, negatives;
+    double build_nanos, hit_nanos, miss_nanos, xor_bits_per_key, xor_fpr, bloom_bits_per_key;
+    long num_keys, false_positives;
+    XorFilter xor_filter;
+    KEY_t key;
+    int opt;
+
+    num_keys = 1000000;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': num_keys = atol(optarg); break;
+        default: die("Usage: " + string(argv[0]) + " [-n keys]");
+        }
+    }
+
+    if (num_keys < 1) {
+        die("At least one key is needed.");
+    }
+
+    mt19937 rng(1);
+
+    while (key_set.size() < num_keys) {
+        key_set.insert((KEY_t)rng());
+    }
+
+    keys.assign(key_set.begin(), key_set.end());
+
+    while (negatives.size() < NEGATIVE_PROBES) {
+        key = (KEY_t)rng();
+        if (key_set.count(key) == 0) {
+            negatives.push_back(key);
+        }
+    }
+
+    // XOR filter
+    auto start = chrono::steady_clock::now();
+    xor_filter.build(keys);
+    build_nanos = nanos_since(start) / keys.size();
+
+    if (probe(xor_filter, keys, hit_nanos) != keys.size()) {
+        die("XOR filter missed a key.");
+    }
+
+    false_positives = probe(xor_filter, negatives, miss_nanos);
+    xor_bits_per_key = 8.0 * xor_filter.size_bytes() / keys.size();
+    print_result("xor", xor_bits_per_key, build_nanos, hit_nanos, miss_nanos, false_positives);
+
+    // A Bloom filter with the same memory
+    bench_bloom("bloom_equal_memory", keys, negatives, xor_bits_per_key);
+
+    /*
+     * A Bloom filter with the XOR filter's false positive rate. With three
+     * hash functions and b bits per key the expected rate is
+     * (1 - e^(-3 / b))^3, solved here for b.
+     */
+    xor_fpr = max((double)false_positives / NEGATIVE_PROBES, 1.0 / 256);
+    bloom_bits_per_key = -3 / log(1 - cbrt(xor_fpr));
+    bench_bloom("bloom_equal_fpr", keys, negatives, bloom_bits_per_key);
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+# Checks the value log mode (-V) of bin/lsm against a reference model.
+#
+# Usage: python3 scripts/test_value_log.py [path to lsm binary]
+
+import json
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+LSM = sys.argv[1] if len(sys.argv) > 1 else "bin/lsm"
+TIMEOUT = 60
+
+failures = 0
+
+def run(workload, flags):
+    with tempfile.TemporaryDirectory() as tmp:
+        args = [LSM, "-V", os.path.join(tmp, "values.log")] + flags
+        return subprocess.run(args, input=workload.encode(), stdout=subprocess.PIPE,
+                              stderr=subprocess.PIPE, timeout=TIMEOUT)
+
+def check(name, ok, detail=""):
+    global failures
+    print(("ok      " if ok else "FAILED  ") + name)
+    if not ok:
+        failures += 1
+        if detail:
+            print("        " + detail)
+
+# Plain values and merges would be taken for value log handles, so a tree
+# with a value log must reject them instead of reading another key's value
+# or retrying a released handle forever
+def test_rejects_plain_writes():
+    cases = [
+        ("plain put", "P 1 hello\nP 1 world\np 3 0\nG 3\n"),
+        ("merge", "P 1 hello\nP 2 world\nm 1 1\nG 1\n"),
+    ]
+
+    for name, workload in cases:
+        try:
+            result = run(workload, [])
+        except subprocess.TimeoutExpired:
+            check("rejects " + name, False, "timed out")
+            continue
+
+        check("rejects " + name, result.returncode != 0 and result.stdout == b"",
+              "exit %d, output %r" % (result.returncode, result.stdout))
+
+def test_overwrites_and_deletes():
+    workload = "P 1 hello\nP 1 world\nP 2 x\nd 2\nP 3 a b  c\nG 1\nG 2\nG 3\nG 4\n"
+    result = run(workload, [])
+    check("overwrites and deletes", result.stdout == b"world\n\na b  c\n\n",
+          "output %r" % result.stdout)
+
+# Random puts, deletes and range deletes over small buffers, so that
+# compactions release handles and the log is collected many times. Shards
+# each see too few writes to be sure of a collection.
+def test_random(seed, flags, collects=True):
+    random.seed(seed)
+    reference = {}
+    commands, expected = [], []
+
+    for _ in range(40000):
+        key = random.randrange(2000)
+        op = random.random()
+
+        if op < 0.55:
+            value = "v%d-" % key + "x" * random.randrange(400)
+            commands.append("P %d %s" % (key, value))
+            reference[key] = value
+        elif op < 0.65:
+            commands.append("d %d" % key)
+            reference.pop(key, None)
+        elif op < 0.67:
+            end = key + random.randrange(1, 200)
+            commands.append("D %d %d" % (key, end))
+            for k in range(key, end):
+                reference.pop(k, None)
+        else:
+            commands.append("G %d" % key)
+            expected.append(reference.get(key, ""))
+
+    for key in range(2000):
+        commands.append("G %d" % key)
+        expected.append(reference.get(key, ""))
+
+    commands.append("j")
+    result = run("\n".join(commands) + "\n", ["-b", "1", "-f", "3", "-G", "0.2,0"] + flags)
+    lines = result.stdout.decode().split("\n")
+    name = "random seed %d %s" % (seed, " ".join(flags))
+
+    if result.returncode != 0 or lines[:len(expected)] != expected:
+        check(name, False, "exit %d, %s" % (result.returncode, result.stderr.decode().strip()))
+        return
+
+    metrics = json.loads(lines[len(expected)])
+    check(name, not collects or metrics["value_log_collections"] > 0, "the log was never collected")
+
+test_rejects_plain_writes()
+test_overwrites_and_deletes()
+test_random(1, [])
+test_random(2, ["-B", "append"])
+test_random(3, ["-N", "3"], False)
+
+sys.exit(1 if failures > 0 else 0)
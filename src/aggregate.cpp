@@ -0,0 +1,82 @@
+#include <algorithm>
+
+#include "aggregate.h"
+
+/*
+ * GCC only vectorises loops at -O2 when it needs no scalar epilogue, which
+ * the folds below do, so they ask for the full vectoriser themselves. Clang
+ * vectorises them at -O2 already.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define VECTORIZE __attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define VECTORIZE
+#endif
+
+void RangeAggregate::clear(void) {
+    count = 0;
+    sum = 0;
+    min = VAL_MAX;
+    max = VAL_MIN;
+}
+
+VECTORIZE
+void RangeAggregate::add(const VAL_t *values, long num_values) {
+    long chunk_sum = 0;
+    VAL_t chunk_min = min, chunk_max = max;
+
+    for (long i = 0; i < num_values; i++) {
+        chunk_sum += values[i];
+        chunk_min = std::min(chunk_min, values[i]);
+        chunk_max = std::max(chunk_max, values[i]);
+    }
+
+    count += num_values;
+    sum += chunk_sum;
+    min = chunk_min;
+    max = chunk_max;
+}
+
+VECTORIZE
+void RangeAggregate::add(const entry_t *entries, long num_entries) {
+    long chunk_count = 0, chunk_sum = 0;
+    VAL_t chunk_min = min, chunk_max = max;
+
+    /*
+     * Tombstones are masked out rather than branched over, so that the loop
+     * vectorises: the mask is all ones for a live value and zero for a
+     * tombstone. The tombstone is smaller than any value, so it never
+     * changes the maximum and needs no masking there.
+     */
+    for (long i = 0; i < num_entries; i++) {
+        VAL_t val = entries[i].val;
+        VAL_t live = -(VAL_t)(val != VAL_TOMBSTONE);
+
+        chunk_count -= live;
+        chunk_sum += val & live;
+        chunk_min = std::min(chunk_min, (VAL_t)((val & live) | (~live & VAL_MAX)));
+        chunk_max = std::max(chunk_max, val);
+    }
+
+    count += chunk_count;
+    sum += chunk_sum;
+    min = chunk_min;
+    max = chunk_max;
+}
+
+void RangeAggregate::add(const RangeAggregate& other) {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+void RangeAggregate::print(ostream& stream) const {
+    stream << count << " " << sum;
+
+    if (count > 0) {
+        stream << " " << min << " " << max;
+    }
+
+    stream << endl;
+}
@@ -0,0 +1,41 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <iostream>
+
+#include "types.h"
+
+using namespace std;
+
+// Number of merged values collected before they are folded in one pass
+#define AGGREGATE_CHUNK_VALUES 1024
+
+/*
+ * The RangeAggregate class folds the live values of a key range into their
+ * count, sum, minimum and maximum, without materialising the entries. The
+ * folds run over contiguous arrays with branch-free loop bodies so that the
+ * compiler can vectorise them.
+ */
+class RangeAggregate {
+public:
+    long count;
+    long sum;
+    VAL_t min, max;
+
+    RangeAggregate(void) {clear();}
+    void clear(void);
+
+    // Folds in an array of live values
+    void add(const VAL_t *, long);
+
+    // Folds in the live values of an array of entries, skipping tombstones
+    void add(const entry_t *, long);
+
+    // Folds in the aggregate of a disjoint key range
+    void add(const RangeAggregate&);
+
+    // Prints "count sum min max" on a single line, or "0 0" for an empty range
+    void print(ostream&) const;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "alloc_counter.h"
+
+using namespace std;
+
+#ifdef COUNT_ALLOCATIONS
+
+static atomic<long> allocations(0);
+
+long allocation_count(void) {
+    return allocations.load(memory_order_relaxed);
+}
+
+/*
+ * Replacements for the global allocation functions. The remaining forms
+ * (arrays and nothrow) are defined by the standard library in terms of
+ * these two.
+ */
+
+void * operator new(size_t size) {
+    void *ptr;
+
+    allocations.fetch_add(1, memory_order_relaxed);
+
+    ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+#else
+
+long allocation_count(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+// Returns the number of heap allocations made by the process so far. The
+// count is kept by replacing the global operator new, so allocations made
+// by the standard library's containers are included. The replacement costs
+// an atomic increment per allocation, so it is only built with
+// COUNT_ALLOCATIONS defined (as the benchmark is); otherwise the count is
+// always 0.
+long allocation_count(void);
+
+#endif
@@ -1,17 +1,77 @@
 // Include required header files
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <tuple>
 #include "buffer.h"
+#include "radix_sort.h"
+#include "sys.h"
 
 // Use the standard namespace
 using namespace std;
 
+buffer_mode parse_buffer_mode(string name) {
+    if (name == "sorted") {
+        return BUFFER_SORTED;
+    } else if (name == "append") {
+        return BUFFER_APPEND;
+    }
+
+    die("Unknown buffer mode '" + name + "': use sorted or append.");
+    return BUFFER_SORTED;
+}
+
+void Buffer::set_mode(buffer_mode new_mode) {
+    int bits;
+
+    mode = new_mode;
+    entries.clear();
+    log.clear();
+    index.clear();
+    deleted.clear();
+    operands.clear();
+
+    if (mode == BUFFER_APPEND) {
+        // Keep the hash index at most half full
+        for (bits = 1; (1L << bits) < 2L * max_size; bits++);
+
+        log.reserve(max_size);
+        index.assign(1L << bits, 0);
+        index_shift = 32 - bits;
+    }
+}
+
+// Returns the slot of the key in the hash index, or of the empty slot
+// where it would be inserted
+long Buffer::find(KEY_t key) const {
+    long slot, mask;
+
+    mask = index.size() - 1;
+
+    for (slot = ((uint32_t)key * 2654435761u) >> index_shift;
+         index[slot] != 0 && log[index[slot] - 1].key != key;
+         slot = (slot + 1) & mask);
+
+    return slot;
+}
+
 // Function to get a value from the buffer by key
-VAL_t * Buffer::get(KEY_t key) const {
+bool Buffer::get(KEY_t key, VAL_t& val) const {
     // Declare necessary variables
     entry_t search_entry;
     set<entry_t>::iterator entry;
-    VAL_t *val;
+    long slot;
+
+    if (mode == BUFFER_APPEND) {
+        slot = find(key);
+
+        if (index[slot] == 0) {
+            return false;
+        }
+
+        val = log[index[slot] - 1].val;
+        return true;
+    }
 
     // Set the search_entry key
     search_entry.key = key;
@@ -19,22 +79,36 @@ VAL_t * Buffer::get(KEY_t key) const {
     // Find the entry with the given key
     entry = entries.find(search_entry);
 
-    // If the entry is not found, return nullptr
+    // If the entry is not found, return false
     if (entry == entries.end()) {
-        return nullptr;
+        return false;
     } else {
-        // If the entry is found, allocate memory for val and return it
-        val = new VAL_t;
-        *val = entry->val;
-        return val;
+        // If the entry is found, copy its value out
+        val = entry->val;
+        return true;
     }
 }
 
 // Function to get a range of entries within the specified key range
-vector<entry_t> * Buffer::range(KEY_t start, KEY_t end) const {
+void Buffer::range(KEY_t start, KEY_t end, vector<entry_t>& subrange) const {
     // Declare necessary variables
     entry_t search_entry;
     set<entry_t>::iterator subrange_start, subrange_end;
+    long first;
+
+    // Append buffers are unordered, so collect the matches and sort them
+    if (mode == BUFFER_APPEND) {
+        first = subrange.size();
+
+        for (const auto& entry : log) {
+            if (start <= entry.key && entry.key <= end) {
+                subrange.push_back(entry);
+            }
+        }
+
+        sort(subrange.begin() + first, subrange.end());
+        return;
+    }
 
     // Set the search_entry key to the start of the range
     search_entry.key = start;
@@ -44,16 +118,65 @@ vector<entry_t> * Buffer::range(KEY_t start, KEY_t end) const {
     search_entry.key = end;
     subrange_end = entries.upper_bound(search_entry);
 
-    // Return a new vector containing the entries within the range
-    return new vector<entry_t>(subrange_start, subrange_end);
+    // Append the entries within the range to the caller's vector
+    subrange.insert(subrange.end(), subrange_start, subrange_end);
 }
 
 // Function to put an entry in the buffer
 bool Buffer::put(KEY_t key, VAL_t val) {
+    // A put replaces any operand buffered for the key
+    if (!operands.empty()) {
+        operands.erase(key);
+    }
+
+    return update(key, val);
+}
+
+// Function to combine a merge operand into the buffer
+bool Buffer::merge(KEY_t key, VAL_t operand, const merge_operator& op) {
+    VAL_t val;
+
+    if (!get(key, val)) {
+        if (!update(key, operand)) {
+            return false;
+        }
+
+        operands.insert(key);
+        return true;
+    }
+
+    // An operand over a tombstone has nothing older to combine with
+    return update(key, val == VAL_TOMBSTONE ? operand : op(val, operand));
+}
+
+// Function to set a key's entry in the buffer, replacing any entry it
+// already has, returning false if a new entry does not fit
+bool Buffer::update(KEY_t key, VAL_t val) {
     // Declare necessary variables
     entry_t entry;
     set<entry_t>::iterator it;
     bool found;
+    long slot;
+
+    if (mode == BUFFER_APPEND) {
+        slot = find(key);
+
+        // Overwrite the key's entry in place if it is already buffered
+        if (index[slot] != 0) {
+            log[index[slot] - 1].val = val;
+            return true;
+        }
+
+        if (log.size() == max_size) {
+            return false;
+        }
+
+        entry.key = key;
+        entry.val = val;
+        log.push_back(entry);
+        index[slot] = log.size();
+        return true;
+    }
 
     // If the buffer is full, return false
     if (entries.size() == max_size) {
@@ -77,7 +200,111 @@ bool Buffer::put(KEY_t key, VAL_t val) {
     }
 }
 
+// Function to put a batch of entries sorted by key in the buffer
+long Buffer::put_sorted(const entry_t *batch, long num_entries) {
+    set<entry_t>::iterator hint;
+    long i;
+    int steps;
+
+    if (mode == BUFFER_APPEND) {
+        for (i = 0; i < num_entries && put(batch[i].key, batch[i].val); i++);
+        return i;
+    }
+
+    hint = entries.begin();
+
+    for (i = 0; i < num_entries; i++) {
+        // The entry belongs at or after the previous one. Step over a few
+        // buffered keys to reach its position before falling back to a
+        // search of the set.
+        for (steps = 0; hint != entries.end() && hint->key < batch[i].key
+                        && steps < BUFFER_HINT_STEPS; steps++) {
+            hint++;
+        }
+
+        if (hint != entries.end() && hint->key < batch[i].key) {
+            hint = entries.lower_bound(batch[i]);
+        }
+
+        // Replace the key's entry if it is already buffered
+        if (hint != entries.end() && hint->key == batch[i].key) {
+            hint = entries.erase(hint);
+        } else if (entries.size() == max_size) {
+            return i;
+        }
+
+        if (!operands.empty()) {
+            operands.erase(batch[i].key);
+        }
+
+        // Inserting right before the hint takes amortised constant time
+        hint = next(entries.insert(hint, batch[i]));
+    }
+
+    return num_entries;
+}
+
+// Function to delete a range of keys from the buffer and the runs
+void Buffer::delete_range(KEY_t start, KEY_t end) {
+    entry_t search_entry;
+    long kept;
+
+    if (start > end) {
+        return;
+    }
+
+    if (mode == BUFFER_APPEND) {
+        // Close up the log over the removed entries and reindex the rest
+        kept = 0;
+
+        for (const auto& entry : log) {
+            if (entry.key < start || entry.key > end) {
+                log[kept++] = entry;
+            }
+        }
+
+        if (kept < log.size()) {
+            log.resize(kept);
+            memset(index.data(), 0, index.size() * sizeof(int32_t));
+
+            for (long i = 0; i < kept; i++) {
+                index[find(log[i].key)] = i + 1;
+            }
+        }
+    } else {
+        search_entry.key = start;
+        auto first = entries.lower_bound(search_entry);
+        search_entry.key = end;
+        entries.erase(first, entries.upper_bound(search_entry));
+    }
+
+    for (auto it = operands.begin(); it != operands.end(); ) {
+        it = *it >= start && *it <= end ? operands.erase(it) : next(it);
+    }
+
+    deleted.add(start, end);
+}
+
+// Function to return the buffer's entries in key order
+const vector<entry_t>& Buffer::sorted(WorkerPool *pool) {
+    if (mode == BUFFER_APPEND) {
+        sorted_entries.assign(log.begin(), log.end());
+        radix_sort(sorted_entries, scratch, pool);
+    } else {
+        sorted_entries.assign(entries.begin(), entries.end());
+    }
+
+    return sorted_entries;
+}
+
 // Function to clear the buffer
 void Buffer::empty(void) {
     entries.clear();
+    deleted.clear();
+    operands.clear();
+
+    if (mode == BUFFER_APPEND) {
+        log.clear();
+        memset(index.data(), 0, index.size() * sizeof(int32_t));
+    }
 }
\ No newline at end of file
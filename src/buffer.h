@@ -1,32 +1,94 @@
 #include <set>
+#include <string>
+#include <unordered_set>
 #include <vector>
 
+#include "merge_operator.h"
+#include "range_tombstones.h"
 #include "types.h"
 
 using namespace std;
 
+class WorkerPool;
+
+// Number of buffered keys a sorted batch insert steps over to reach each
+// entry's position before searching for it
+#define BUFFER_HINT_STEPS 8
+
+// How the buffer holds its entries. Sorted buffers keep them in an ordered
+// set. Append buffers add them to a flat array with a hash index over the
+// keys, and only sort them when they are flushed or read as a whole, which
+// makes puts much cheaper for write-heavy workloads at the cost of slower
+// range queries over the buffer.
+enum buffer_mode {BUFFER_SORTED, BUFFER_APPEND};
+
+// Parses a buffer mode name, "sorted" or "append"
+buffer_mode parse_buffer_mode(string);
+
 // The Buffer class represents an in-memory buffer for the LSM tree,
 // storing key-value pairs as they are inserted
 class Buffer {
+    buffer_mode mode;
+    set<entry_t> entries; // A sorted set of entries, in sorted mode
+    vector<entry_t> log; // Entries in insertion order, one per key, in append mode
+    vector<int32_t> index; // Open addressing hash table of positions in the log plus one
+    int index_shift;
+    vector<entry_t> sorted_entries, scratch;
+    RangeTombstones deleted; // Ranges deleted from the runs
+    unordered_set<KEY_t> operands; // Keys whose entries are merge operands
+    long find(KEY_t) const;
+    bool update(KEY_t, VAL_t);
 public:
     int max_size; // Maximum number of entries the buffer can hold
-    set<entry_t> entries; // A sorted set of entries in the buffer
 
     // Constructor for the Buffer class, initializing its maximum size
-    Buffer(int max_size) : max_size(max_size) {};
+    Buffer(int max_size) : max_size(max_size) {set_mode(BUFFER_SORTED);}
+
+    // Switches an empty buffer to the given mode
+    void set_mode(buffer_mode);
+
+    // Returns the number of entries in the buffer
+    long size(void) const {return mode == BUFFER_SORTED ? entries.size() : log.size();}
 
-    // Searches the buffer for a key and returns a pointer to the value if found,
-    // otherwise returns a nullptr
-    VAL_t * get(KEY_t) const;
+    // Searches the buffer for a key and stores its value in val if found,
+    // returning whether the key was found
+    bool get(KEY_t, VAL_t& val) const;
 
-    // Searches the buffer for entries within a specified key range and returns
-    // a pointer to a vector of entries within the range
-    vector<entry_t> * range(KEY_t, KEY_t) const;
+    // Returns whether the key's entry is a merge operand, to be combined
+    // with the key's value in the runs
+    bool is_operand(KEY_t key) const {return !operands.empty() && operands.count(key) > 0;}
+    bool has_operands(void) const {return !operands.empty();}
+
+    // Searches the buffer for entries within a specified key range and appends
+    // them to the caller's vector
+    void range(KEY_t, KEY_t, vector<entry_t>&) const;
 
     // Inserts a key-value pair into the buffer, returning true if successful
     // or false if the buffer is full
     bool put(KEY_t, VAL_t val);
 
-    // Empties the buffer, removing all entries
+    // Inserts entries with distinct keys in ascending key order, stopping
+    // once the buffer is full, and returns the number inserted. Sorted
+    // buffers insert each entry next to the previous one rather than
+    // searching the whole set for it.
+    long put_sorted(const entry_t *, long);
+
+    // Combines an operand into the key's buffered entry with the merge
+    // operator, or buffers it as an operand if the key has no entry.
+    // Returns false if the buffer is full.
+    bool merge(KEY_t, VAL_t, const merge_operator&);
+
+    // Removes the buffer's entries within an inclusive key range and records
+    // a range tombstone deleting the range from the runs
+    void delete_range(KEY_t, KEY_t);
+
+    // Returns the range tombstones recorded since the buffer was last emptied
+    const RangeTombstones& range_tombstones(void) const {return deleted;}
+
+    // Returns the buffer's entries in key order. Append buffers radix sort
+    // a copy of their entries, on the pool's workers if one is given.
+    const vector<entry_t>& sorted(WorkerPool *);
+
+    // Empties the buffer, removing all entries and range tombstones
     void empty(void);
 };
@@ -0,0 +1,105 @@
+#include <iomanip>
+
+#include "histogram.h"
+
+using namespace std;
+
+Histogram latency_histograms[NUM_LATENCY_OPS];
+
+static const char *latency_op_names[NUM_LATENCY_OPS] = {
+    "put",
+    "get_hit",
+    "get_miss",
+    "range",
+    "delete",
+    "merge",
+    "write_batch",
+    "flush",
+    "compaction",
+};
+
+Histogram::Histogram(void) : total(0), maximum(0) {
+    for (auto& bucket : buckets) {
+        bucket = 0;
+    }
+}
+
+// Values below HISTOGRAM_SUB_BUCKETS are counted exactly. Larger values are
+// bucketed by the position of their highest set bit, and within that by the
+// HISTOGRAM_SUB_BUCKET_BITS bits that follow it.
+int Histogram::bucket_of(long value) {
+    int msb;
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value < 0 ? 0 : value;
+    }
+
+    msb = 63 - __builtin_clzl(value);
+
+    return (msb - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+         + ((value >> (msb - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Returns the largest value counted by a bucket
+long Histogram::bucket_limit(int bucket) {
+    int shift, sub_bucket;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return ((long)(HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void Histogram::record(long value) {
+    long current;
+
+    buckets[bucket_of(value)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+
+    current = maximum.load(memory_order_relaxed);
+    while (value > current && !maximum.compare_exchange_weak(current, value, memory_order_relaxed)) {}
+}
+
+long Histogram::percentile(double fraction) const {
+    long target, seen;
+    int i;
+
+    target = (long)(fraction * count() + 0.5);
+    if (target < 1) target = 1;
+
+    seen = 0;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i].load(memory_order_relaxed);
+
+        if (seen >= target) {
+            // A bucket's limit may exceed the largest value actually recorded
+            return min(bucket_limit(i), max());
+        }
+    }
+
+    return max();
+}
+
+void print_latencies(ostream& stream) {
+    ios::fmtflags flags = stream.flags();
+
+    stream << fixed << setprecision(1);
+
+    // Latencies are recorded in nanoseconds and printed in microseconds
+    for (int i = 0; i < NUM_LATENCY_OPS; i++) {
+        const Histogram& histogram = latency_histograms[i];
+
+        stream << latency_op_names[i] << ": count: " << histogram.count()
+               << ", p50: " << histogram.percentile(0.5) / 1000.0 << " us"
+               << ", p99: " << histogram.percentile(0.99) / 1000.0 << " us"
+               << ", p999: " << histogram.percentile(0.999) / 1000.0 << " us"
+               << ", max: " << histogram.max() / 1000.0 << " us" << endl;
+    }
+
+    stream.flags(flags);
+}
@@ -0,0 +1,64 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+// Each power-of-two range of values is split into 2^HISTOGRAM_SUB_BUCKET_BITS
+// linear sub-buckets, bounding the relative error of a recorded value to
+// about 1 / 2^HISTOGRAM_SUB_BUCKET_BITS
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// The Histogram class counts non-negative values in log-linear buckets, in
+// the manner of an HDR histogram. Recording is lock-free and may happen
+// from any number of threads at once.
+class Histogram {
+    std::atomic<long> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<long> total;
+    std::atomic<long> maximum;
+    static int bucket_of(long);
+    static long bucket_limit(int);
+public:
+    Histogram(void);
+    void record(long);
+    long count(void) const {return total.load(std::memory_order_relaxed);}
+    long max(void) const {return maximum.load(std::memory_order_relaxed);}
+    // Returns the value below which the given fraction of recorded values fall
+    long percentile(double) const;
+};
+
+// Operations whose latencies are tracked
+enum latency_op {
+    LATENCY_PUT,
+    LATENCY_GET_HIT,
+    LATENCY_GET_MISS,
+    LATENCY_RANGE,
+    LATENCY_DELETE,
+    LATENCY_MERGE,
+    LATENCY_WRITE_BATCH,
+    LATENCY_FLUSH, // Writing the buffer out as a level 1 run
+    LATENCY_COMPACTION, // Merging one level into the next
+    NUM_LATENCY_OPS
+};
+
+// Process-wide latency histograms, in nanoseconds, indexed by latency_op
+extern Histogram latency_histograms[NUM_LATENCY_OPS];
+
+// Returns the current time for measuring latencies
+inline std::chrono::steady_clock::time_point latency_start(void) {
+    return std::chrono::steady_clock::now();
+}
+
+// Records the time elapsed since start against an operation
+inline void latency_record(latency_op op, std::chrono::steady_clock::time_point start) {
+    latency_histograms[op].record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// Prints the count, p50, p99, p999 and maximum latency of each operation
+void print_latencies(std::ostream&);
+
+#endif
@@ -0,0 +1,307 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "sys.h"
+
+using namespace std;
+
+static string io_backend = "auto";
+
+// Transfers the whole request, retrying after short reads and writes.
+// Bytes past the end of the file read back as zeroes.
+static void transfer(io_request request) {
+    ssize_t result;
+
+    while (request.len > 0) {
+        if (request.opcode == IO_READ) {
+            result = pread(request.fd, request.buf, request.len, request.offset);
+        } else {
+            result = pwrite(request.fd, request.buf, request.len, request.offset);
+        }
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0) {
+            die("I/O error: " + string(strerror(errno)));
+        } else if (result == 0 && request.opcode == IO_READ) {
+            memset(request.buf, 0, request.len);
+            return;
+        }
+
+        request.buf += result;
+        request.len -= result;
+        request.offset += result;
+    }
+}
+
+/*
+ * pread backend
+ */
+
+// Requests are complete once queued, so any token will do
+io_token PreadQueue::queue(io_request request) {
+    transfer(request);
+    return IO_NO_REQUEST;
+}
+
+/*
+ * io_uring backend
+ *
+ * The rings are driven through the raw system calls so that no library
+ * beyond the kernel headers is needed.
+ */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Returns whether the ring takes plain read and write requests. Kernels
+// before 5.6 have neither those nor the probe, so a failed probe means no.
+static bool supports_read_write(int ring_fd) {
+    const unsigned num_ops = 256;
+    struct io_uring_probe *probe;
+    bool supported;
+
+    probe = (struct io_uring_probe *)calloc(1, sizeof(*probe)
+                                              + num_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        die("Could not allocate an io_uring probe.");
+    }
+
+    supported = io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, num_ops) == 0
+        && probe->last_op >= IORING_OP_READ && probe->last_op >= IORING_OP_WRITE
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+UringQueue::UringQueue(unsigned depth) : depth(depth) {
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    sq_ring = cq_ring = sqes = MAP_FAILED;
+    first_token = 0;
+    next_submit = 0;
+    in_flight = unsubmitted = 0;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = io_uring_setup(depth, &params);
+
+    if (ring_fd < 0) {
+        return;
+    }
+
+    if (!supports_read_write(ring_fd)) {
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+
+    sq = (char *)sq_ring;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    // Never keep more requests in flight than the submission ring holds,
+    // so the completion ring (twice as large) cannot overflow.
+    this->depth = params.sq_entries;
+}
+
+UringQueue::~UringQueue(void) {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+io_token UringQueue::queue(io_request request) {
+    requests.push_back(request);
+    finished.push_back(false);
+
+    // Keep the ring busy instead of holding requests back until a wait
+    if (requests.size() - next_submit >= depth) {
+        drive(IO_NO_REQUEST);
+    }
+
+    return first_token + requests.size() - 1;
+}
+
+// Moves queued requests into the submission ring and hands them to the
+// kernel. Given a request's token, returns only once that request has
+// completed; given IO_NO_REQUEST, waits only when the ring is full.
+void UringQueue::drive(io_token until) {
+    struct io_uring_sqe *sqe;
+    unsigned tail, wait_for;
+    int result;
+
+    while (true) {
+        tail = *sq_tail;
+
+        while (next_submit < requests.size() && in_flight < depth) {
+            const io_request& request = requests[next_submit];
+
+            sqe = (struct io_uring_sqe *)sqes + (tail & *sq_mask);
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request.opcode == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->fd = request.fd;
+            sqe->addr = (unsigned long)request.buf;
+            sqe->len = request.len;
+            sqe->off = request.offset;
+            sqe->user_data = first_token + next_submit;
+            sq_array[tail & *sq_mask] = tail & *sq_mask;
+
+            tail++;
+            next_submit++;
+            in_flight++;
+            unsubmitted++;
+        }
+
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (until != IO_NO_REQUEST) {
+            wait_for = is_finished(until) ? 0 : 1;
+        } else {
+            wait_for = next_submit < requests.size() ? 1 : 0;
+        }
+
+        if (unsubmitted == 0 && wait_for == 0) {
+            return;
+        }
+
+        result = io_uring_enter(ring_fd, unsubmitted, wait_for,
+                                wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0) {
+            die("io_uring_enter failed: " + string(strerror(errno)));
+        }
+
+        unsubmitted -= result;
+        reap();
+    }
+}
+
+// Collects completions, finishing any short transfers synchronously, and
+// forgets the requests up to the oldest one still incomplete
+void UringQueue::reap(void) {
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    size_t index;
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        cqe = (struct io_uring_cqe *)cqes + (head & *cq_mask);
+        index = cqe->user_data - first_token;
+        io_request request = requests[index];
+
+        if (cqe->res < 0) {
+            die("I/O error: " + string(strerror(-cqe->res)));
+        } else if (cqe->res < request.len) {
+            request.buf += cqe->res;
+            request.len -= cqe->res;
+            request.offset += cqe->res;
+            transfer(request);
+        }
+
+        finished[index] = true;
+        in_flight--;
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    while (!finished.empty() && finished.front()) {
+        requests.pop_front();
+        finished.pop_front();
+        first_token++;
+        next_submit--;
+    }
+}
+
+void UringQueue::wait_all(void) {
+    io_token end = first_token + requests.size();
+
+    for (io_token token = first_token; token < end; token++) {
+        drive(token);
+    }
+}
+
+/*
+ * Backend selection
+ */
+
+void set_io_backend(string backend) {
+    if (backend != "auto" && backend != "uring" && backend != "pread") {
+        die("Unknown I/O backend '" + backend + "'.");
+    }
+
+    io_backend = backend;
+}
+
+IOQueue& io_queue(void) {
+    static thread_local unique_ptr<IOQueue> queue;
+    UringQueue *uring;
+
+    if (queue == nullptr) {
+        if (io_backend != "pread") {
+            uring = new UringQueue(IO_QUEUE_DEPTH);
+
+            if (uring->ok()) {
+                queue.reset(uring);
+            } else if (io_backend == "uring") {
+                die("io_uring is not available or does not support reads and writes.");
+            } else {
+                delete uring;
+            }
+        }
+
+        if (queue == nullptr) {
+            queue.reset(new PreadQueue());
+        }
+    }
+
+    return *queue;
+}
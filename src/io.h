@@ -0,0 +1,131 @@
+#ifndef IO_H
+#define IO_H
+
+#include <deque>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Maximum number of requests a queue keeps in flight at once
+#define IO_QUEUE_DEPTH 64
+
+using namespace std;
+
+// A single read or write of a contiguous byte range of a file
+struct io_request {
+    int opcode; // IO_READ or IO_WRITE
+    int fd; // File descriptor to transfer from or to
+    char *buf; // Memory to transfer into or out of
+    size_t len; // Number of bytes to transfer
+    off_t offset; // Position in the file
+};
+
+#define IO_READ 0
+#define IO_WRITE 1
+
+// Identifies a queued request to wait for. Tokens increase with every
+// request a queue is given; waiting on one that has completed, or on
+// IO_NO_REQUEST, returns at once.
+typedef long io_token;
+
+#define IO_NO_REQUEST -1
+
+// The IOQueue class collects page reads and writes and completes them
+// together. Requests may be carried out as soon as they are queued, so the
+// caller must not touch a request's buffer until wait() for its token or
+// wait_all() returns. Streams that share a thread's queue, such as the
+// inputs and output of a merge, wait on their own tokens so that none of
+// them waits for the others' requests.
+class IOQueue {
+public:
+    virtual ~IOQueue(void) {}
+
+    // Queues a read of len bytes at offset into buf
+    io_token read(int fd, void *buf, size_t len, off_t offset) {
+        return queue({IO_READ, fd, (char *)buf, len, offset});
+    }
+
+    // Queues a write of len bytes from buf to offset
+    io_token write(int fd, const void *buf, size_t len, off_t offset) {
+        return queue({IO_WRITE, fd, (char *)buf, len, offset});
+    }
+
+    // Starts servicing the queued requests without waiting for them
+    virtual void submit(void) = 0;
+
+    // Blocks until the request has completed
+    virtual void wait(io_token) = 0;
+
+    // Blocks until every queued request has completed
+    virtual void wait_all(void) = 0;
+
+    // Returns true if queued requests are serviced concurrently, so that
+    // submitting many of them before waiting is worthwhile
+    virtual bool is_async(void) const = 0;
+
+    virtual const char * name(void) const = 0;
+protected:
+    virtual io_token queue(io_request) = 0;
+};
+
+// Carries out each request synchronously with pread/pwrite as it is queued
+class PreadQueue : public IOQueue {
+public:
+    void submit(void) {}
+    void wait(io_token) {}
+    void wait_all(void) {}
+    bool is_async(void) const {return false;}
+    const char * name(void) const {return "pread";}
+protected:
+    io_token queue(io_request);
+};
+
+// Submits requests to the kernel through an io_uring submission ring, so a
+// single thread can keep up to IO_QUEUE_DEPTH requests in flight
+class UringQueue : public IOQueue {
+    int ring_fd;
+    unsigned depth;
+
+    // Submission and completion rings shared with the kernel
+    void *sq_ring, *cq_ring, *sqes;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+
+    // Requests from the oldest one still incomplete onwards, and whether
+    // each has completed
+    deque<io_request> requests;
+    deque<bool> finished;
+    io_token first_token; // Token of the first of the requests
+    size_t next_submit; // Index of the first request not yet in the ring
+    unsigned in_flight, unsubmitted;
+
+    bool is_finished(io_token token) const {
+        return token < first_token || finished[token - first_token];
+    }
+
+    void drive(io_token);
+    void reap(void);
+public:
+    UringQueue(unsigned);
+    ~UringQueue(void);
+    bool ok(void) const {return ring_fd >= 0;}
+    void submit(void) {drive(IO_NO_REQUEST);}
+    void wait(io_token token) {drive(token);}
+    void wait_all(void);
+    bool is_async(void) const {return true;}
+    const char * name(void) const {return "io_uring";}
+protected:
+    io_token queue(io_request);
+};
+
+// Selects the backend used by queues created after the call: "uring",
+// "pread", or "auto" (io_uring when the kernel supports it and its read and
+// write requests, else pread)
+void set_io_backend(string);
+
+// Returns the calling thread's I/O queue, creating it on first use
+IOQueue& io_queue(void);
+
+#endif
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <memory>
 #include <queue>
+#include <utility>
 
 #include "run.h"
 
@@ -7,12 +10,81 @@ class Level {
 public:
     int max_runs; // Maximum number of runs allowed in the level
     long max_run_size; // Maximum size of a run in the level
-    std::deque<Run> runs; // A deque of runs in the level
+    // A deque of runs in the level. Lookups and scans share the runs they
+    // read, so that a merge may replace them while they are being read.
+    std::deque<std::shared_ptr<Run>> runs;
 
     // Constructor for the Level class, initializing the maximum number of runs
     // and the maximum run size
     Level(int n, long s) : max_runs(n), max_run_size(s) {}
 
-    // Returns the number of available spots for runs in the level
-    bool remaining(void) const {return max_runs - runs.size();}
+    // Returns the number of available spots for runs in the level, which is
+    // zero or negative while a level waits for a compaction to catch up.
+    // Runs that share no keys take up a single spot between them, so a
+    // level fills up once some key may be found in max_runs of its runs,
+    // or once it holds as many entries as max_runs full runs.
+    int remaining(void) const {
+        if (entries() >= capacity()) return 0;
+        return max_runs - depth();
+    }
+
+    // Returns the number of entries the level holds once full
+    long capacity(void) const {return max_runs * max_run_size;}
+
+    // Returns the number of entries held by the level's runs
+    long entries(void) const {
+        long total = 0;
+        for (const auto& run : runs) total += run->size;
+        return total;
+    }
+
+    // Returns the number of tombstones held by the level's runs, counting
+    // each range tombstone once
+    long tombstones(void) const {
+        long total = 0;
+        for (const auto& run : runs) total += run->tombstones + run->range_tombstones.size();
+        return total;
+    }
+
+    // Returns when the oldest of the level's tombstones was written, or 0
+    // if it holds none
+    time_t oldest_tombstone(void) const {
+        time_t oldest = 0;
+        for (const auto& run : runs) {
+            if (run->has_tombstones() && (oldest == 0 || run->oldest_tombstone < oldest)) {
+                oldest = run->oldest_tombstone;
+            }
+        }
+        return oldest;
+    }
+
+    // Returns the largest number of the level's runs whose key ranges
+    // include any one key
+    int depth(void) const {
+        std::vector<std::pair<KEY_t, int>> bounds;
+        int current = 0, deepest = 0;
+
+        // Starts sort before ends at the same key, since ranges are inclusive
+        for (const auto& run : runs) {
+            if (run->size == 0) continue;
+            bounds.emplace_back(run->min_key(), -1);
+            bounds.emplace_back(run->last_key(), 1);
+        }
+
+        std::sort(bounds.begin(), bounds.end());
+
+        for (const auto& bound : bounds) {
+            current -= bound.second;
+            deepest = std::max(deepest, current);
+        }
+
+        return deepest;
+    }
+
+    // Returns the number of bytes held by the level's runs
+    long bytes(void) const {
+        long total = 0;
+        for (const auto& run : runs) total += run->size * sizeof(entry_t);
+        return total;
+    }
 };
@@ -1,11 +1,19 @@
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <map>
-#include <chrono>
+#include <queue>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "alloc_counter.h"
+#include "histogram.h"
 #include "lsm_tree.h"
 #include "merge.h"
+#include "metrics.h"
 #include "sys.h"
 
 using namespace std;
@@ -24,323 +32,1596 @@ istream& operator>>(istream& stream, entry_t& entry) {
     return stream;
 }
 
+/*
+ * Lookups and scans pick their runs with the tree mutex held, then read
+ * them without it, so several may be reading at once. Each thread keeps
+ * its own scratch space for them, reused from one call to the next so
+ * that they do not allocate. The runs picked are let go once read: a
+ * merge may have replaced them meanwhile, and their files are only
+ * deleted once no thread holds them.
+ */
+struct tree_scratch {
+    vector<shared_ptr<Run>> candidates; // The runs picked, newest first
+    vector<int> candidate_levels;
+    vector<entry_t> pages;
+    vector<long> page_sizes;
+    vector<RangeTombstones> covering; // The range tombstones newer than each candidate
+    RangeTombstones deleted;
+    vector<KEY_t> buffer_operands;
+    vector<entry_t> flushing_range, buffers_range;
+    deque<RunCursor> cursors;
+    vector<vector<entry_t>> results;
+    vector<entry_t> output;
+    MergeContext merge;
+    vector<VAL_t> values;
+    vector<entry_t> batch;
+
+    // Lets go of the runs picked
+    void release(void) {
+        cursors.clear();
+        candidates.clear();
+    }
+};
+
+// Returns the calling thread's scratch space
+static tree_scratch& thread_scratch(void) {
+    static thread_local tree_scratch scratch;
+    return scratch;
+}
+
 /*
  * LSM Tree
  */
 
 // LSMTree constructor, initializes the LSM tree parameters
 LSMTree::LSMTree(int buffer_max_entries, int depth, int fanout,
-                 int num_threads, float bf_bits_per_entry) :
-                 bf_bits_per_entry(bf_bits_per_entry),
+                 int num_threads, float bf_bits_per_entry,
+                 float rf_bits_per_entry, filter_type filter) :
                  buffer(buffer_max_entries),
-                 worker_pool(num_threads)
+                 flushing(buffer_max_entries),
+                 worker_pool(num_threads),
+                 bf_bits_per_entry(bf_bits_per_entry),
+                 rf_bits_per_entry(rf_bits_per_entry),
+                 filter(filter)
 {
     long max_run_size;
 
     max_run_size = buffer_max_entries;
 
-    // Create levels for the LSM tree with their corresponding sizes
+    // Create the initial levels of the LSM tree with their corresponding
+    // sizes. More are added as the last level fills up.
     while ((depth--) > 0) {
         levels.emplace_back(fanout, max_run_size);
         max_run_size *= fanout;
     }
+
+    set_write_stall(fanout * DEFAULT_STALL_SOFT_RUNS_FACTOR,
+                    fanout * DEFAULT_STALL_HARD_RUNS_FACTOR,
+                    DEFAULT_STALL_SOFT_PENDING_BYTES,
+                    DEFAULT_STALL_HARD_PENDING_BYTES);
+    set_tombstone_compaction(DEFAULT_TOMBSTONE_COMPACTION_DENSITY,
+                             DEFAULT_TOMBSTONE_COMPACTION_AGE);
+    merge_op = merge_add;
+
+    stopping = false;
+    flush_in_progress = false;
+    flushes = 0;
+    compaction_thread = thread(&LSMTree::compaction_loop, this);
+}
+
+// LSMTree destructor, stops the compaction thread once any merge in
+// progress has been installed
+LSMTree::~LSMTree(void) {
+    {
+        lock_guard<mutex> lock(tree_mutex);
+        stopping = true;
+    }
+
+    compaction_cv.notify_all();
+    compaction_thread.join();
+}
+
+// Sets the level 1 run counts and pending compaction bytes at which puts
+// are slowed down (soft) or stopped (hard)
+void LSMTree::set_write_stall(int soft_runs, int hard_runs, long soft_bytes, long hard_bytes) {
+    lock_guard<mutex> lock(tree_mutex);
+
+    stall_soft_runs = soft_runs;
+    stall_hard_runs = max(hard_runs, soft_runs);
+    stall_soft_bytes = soft_bytes;
+    stall_hard_bytes = max(hard_bytes, soft_bytes);
+}
+
+// Sets the tombstone density and the age in seconds of the oldest
+// tombstone at which a level is merged down early. 0 disables a trigger.
+void LSMTree::set_tombstone_compaction(double density, long age) {
+    lock_guard<mutex> lock(tree_mutex);
+
+    tombstone_density = density;
+    tombstone_age = age;
+}
+
+// Switches the buffers between sorted and append mode, flushing them first
+void LSMTree::set_buffer_mode(buffer_mode mode) {
+    unique_lock<mutex> lock(tree_mutex);
+
+    // Writes may refill the buffer while it is being flushed
+    while (flush_in_progress || buffer.size() > 0 || !buffer.range_tombstones().empty()) {
+        flush_buffer(lock);
+    }
+
+    buffer.set_mode(mode);
+    flushing.set_mode(mode);
+}
+
+// Sets the number of lookup outcomes the row cache holds, emptying it.
+// A capacity of 0 disables the cache.
+void LSMTree::set_row_cache(long capacity) {
+    lock_guard<mutex> lock(tree_mutex);
+
+    row_cache.set_capacity(capacity);
+}
+
+// Sets the operator that merge() operands are combined with. It must be
+// set before any operands are written.
+void LSMTree::set_merge_operator(merge_operator op) {
+    lock_guard<mutex> lock(tree_mutex);
+
+    merge_op = op;
+}
+
+// Keeps the tree's values in a value log at the path, collected once the
+// given share of it is garbage and it holds at least the given number of
+// bytes. The tree must be empty. Its entries then hold handles to values
+// written by put_blob, and compactions release the handles of the entries
+// they drop. Plain values and merge operands could not be told apart from
+// handles, so puts and merges of them are refused.
+void LSMTree::set_value_log(string path, double gc_ratio, long gc_min_bytes) {
+    lock_guard<mutex> lock(tree_mutex);
+
+    if (buffer.size() > 0 || flush_in_progress) {
+        die("A value log can only be set on an empty tree.");
+    }
+
+    for (const auto& level : levels) {
+        if (!level.runs.empty()) {
+            die("A value log can only be set on an empty tree.");
+        }
+    }
+
+    value_log.open(path);
+    value_log.set_collection(gc_ratio, gc_min_bytes);
+}
+
+// The compaction thread merges down any level that has filled up,
+// shallowest first, then any level due a merge for its tombstones, and
+// sleeps until a flush fills one again or a tombstone may have aged.
+void LSMTree::compaction_loop(void) {
+    unique_lock<mutex> lock(tree_mutex);
+    int current;
+
+    while (!stopping) {
+        for (current = 0; current < levels.size(); current++) {
+            if (levels[current].remaining() <= 0) break;
+        }
+
+        if (current == levels.size()) {
+            current = tombstone_compaction_level();
+
+            if (current < levels.size()) {
+                metric_add(METRIC_TOMBSTONE_COMPACTIONS);
+            }
+        }
+
+        if (current == levels.size()) {
+            compaction_cv.wait_for(lock, chrono::seconds(TOMBSTONE_CHECK_INTERVAL));
+        } else {
+            compact(current, lock);
+
+            // Wake any writers stalled behind this compaction
+            compaction_cv.notify_all();
+
+            // Collect the value log once merges have left enough of it
+            // garbage. Values can be read and written meanwhile.
+            if (value_log.needs_collection()) {
+                lock.unlock();
+                value_log.collect();
+                lock.lock();
+            }
+        }
+    }
+}
+
+// Returns the shallowest level above the last whose tombstones make up at
+// least the tombstone density of its entries, or whose oldest tombstone is
+// older than the tombstone age, or the number of levels if there is none.
+// Merging such a level down pushes its tombstones towards the last level,
+// where they are dropped along with the entries they delete. The density
+// trigger waits for a full run's worth of tombstones, so that deeper,
+// larger levels are not rewritten for a handful of deletes.
+int LSMTree::tombstone_compaction_level(void) const {
+    time_t now = time(nullptr);
+    int i;
+
+    for (i = 0; i < (int)levels.size() - 1; i++) {
+        const Level& level = levels[i];
+        long tombstones = level.tombstones();
+
+        if (tombstones == 0) {
+            continue;
+        }
+
+        if (tombstone_density > 0 && tombstones >= level.max_run_size
+            && tombstones >= tombstone_density * level.entries()) {
+            return i;
+        }
+
+        if (tombstone_age > 0 && now - level.oldest_tombstone() >= tombstone_age) {
+            return i;
+        }
+    }
+
+    return levels.size();
+}
+
+// Adds an empty level below the last one, holding runs fanout times larger
+void LSMTree::add_level(void) {
+    const Level& last = levels.back();
+
+    levels.emplace_back(last.max_runs, last.max_run_size * last.max_runs);
 }
 
 // This function merges the runs in the current level down to the next level of the LSM tree
-// to create space for new entries. It follows the size-tiered compaction strategy.
-void LSMTree::merge_down(vector<Level>::iterator current) {
-    vector<Level>::iterator next;
+// to create space for new entries. It follows the size-tiered compaction strategy, except
+// in the last level, which holds a single run that merges are folded into (lazy leveling).
+// This keeps at most one stale copy of each entry per level, so space amplification stays
+// bounded as the tree grows.
+//
+// The tree grows from the bottom: once the last level reaches its capacity, its runs are
+// moved (not rewritten) into a new level below, so every level ends up holding about
+// fanout times the data of the level above it, whatever the initial depth.
+//
+// Inputs whose key ranges do not overlap, as with sequential or time-ordered keys, have
+// nothing to merge. They are moved down as they are, keeping their files, filters and
+// fence pointers, so such workloads write each entry about once.
+//
+// It is called on the compaction thread with the tree mutex held, and
+// releases the mutex while merging: the input runs are immutable, and no
+// other thread removes runs from the levels.
+void LSMTree::compact(int current, unique_lock<mutex>& lock) {
     MergeContext merge_ctx;
+    deque<RunReader> readers;
+    vector<Run *> inputs;
+    vector<RangeTombstones> covering;
+    merge_operator op;
+    long merged_size, tombstones_dropped;
     entry_t entry;
+    int next, num_current;
+    bool last, operand;
+
+    // If the current level is the last one, add a level to merge down into
+    if (current >= levels.size() - 1) {
+        add_level();
+    }
+
+    // Set the next level as the target for merging
+    next = current + 1;
+
+    /*
+     * If the next level does not have space for the current level,
+     * recursively merge the next level downwards to create some
+     */
+    if (levels[next].remaining() <= 0) {
+        compact(next, lock);
+        assert(levels[next].remaining() > 0);
+    }
+
+    last = next == levels.size() - 1;
+
+    if (is_trivial_move(current, last)) {
+        for (int i = levels[current].runs.size(); i > 0; i--) {
+            metric_add(METRIC_BYTES_MOVED, levels[current].runs.back()->size * sizeof(entry_t));
+            levels[next].runs.emplace_front(std::move(levels[current].runs.back()));
+            levels[current].runs.pop_back();
+        }
+
+        return;
+    }
+
+    /*
+     * Take the runs currently in the level as the inputs. Runs flushed
+     * into level 1 during the merge are added in front of them, so the
+     * inputs remain the oldest runs of the level.
+     */
+    merged_size = 0;
+
+    for (const auto& run : levels[current].runs) {
+        inputs.push_back(run.get());
+        merged_size += run->size;
+    }
+
+    num_current = inputs.size();
+
+    // Merges into the last level fold in its runs, which are older still
+    if (last) {
+        for (const auto& run : levels[next].runs) {
+            inputs.push_back(run.get());
+            merged_size += run->size;
+        }
+    }
+
+    // Create a new run for the next level to store the merged entries. It
+    // is only installed once complete, so readers never see it half written.
+    Run output(max(merged_size, levels[next].max_run_size),
+               bf_bits_per_entry, rf_bits_per_entry, filter);
+
+    op = merge_op;
+    merge_ctx.set_merge_operator(&op);
+
+    // The values of overwritten and deleted entries become garbage
+    if (value_log.enabled()) {
+        merge_ctx.set_discard_handler([this](const entry_t& entry) {
+            if (entry.val != VAL_TOMBSTONE) {
+                value_log.release(entry.val);
+            }
+        });
+    }
+
+    lock.unlock();
+
+    // Time this merge alone, excluding any merges it triggered below
+    auto start = latency_start();
+
+    /*
+     * Each input's entries are deleted by the range tombstones of the
+     * inputs newer than it. The new run keeps all of their range
+     * tombstones for the older runs of deeper levels, unless it goes
+     * into the last level, below which there is nothing left to delete.
+     */
+    covering.resize(inputs.size() + 1);
+
+    for (int i = 0; i < inputs.size(); i++) {
+        covering[i + 1] = covering[i];
+        covering[i + 1].add(inputs[i]->range_tombstones);
+    }
+
+    if (!last) {
+        output.range_tombstones = covering.back();
+    }
+
+    /*
+     * Merge all input runs into the new run. The runs are streamed
+     * sequentially and dropped from the page cache as they are
+     * consumed, since they are deleted once the merge completes.
+     */
+    for (int i = 0; i < inputs.size(); i++) {
+        readers.emplace_back(*inputs[i], 0, inputs[i]->size, true);
+        merge_ctx.add(&readers.back(), &covering[i], &inputs[i]->operand_keys);
+    }
+
+    // Allocate room for every input entry up front
+    output.open_write(merged_size, true);
+
+    // Iterate through the merged entries and insert them into the new run
+    tombstones_dropped = last ? covering.back().size() : 0;
+
+    while (!merge_ctx.done()) {
+        entry = merge_ctx.next(operand);
+
+        // Unless the entry is a tombstone merged into the last level, where
+        // there is nothing left for it to delete, insert it into the new run.
+        // Operands left over once the last level is folded in become values.
+        if (!(last && entry.val == VAL_TOMBSTONE)) {
+            output.put(entry, operand && !last);
+        } else {
+            tombstones_dropped++;
+        }
+    }
+
+    // Write out the newly created run
+    output.close_write();
+    metric_add(METRIC_BYTES_COMPACTED, output.size * sizeof(entry_t));
+    metric_add(METRIC_TOMBSTONES_DROPPED, tombstones_dropped);
+
+    // The surviving tombstones are as old as the oldest of the inputs'
+    for (auto run : inputs) {
+        if (output.has_tombstones() && run->has_tombstones()
+            && (output.oldest_tombstone == 0 || run->oldest_tombstone < output.oldest_tombstone)) {
+            output.oldest_tombstone = run->oldest_tombstone;
+        }
+    }
+
+    // Release the readers before their runs are deleted
+    readers.clear();
+
+    lock.lock();
+
+    /*
+     * Install the new run at the front of the next level and remove
+     * the inputs from both levels, deleting the old (now redundant)
+     * entry files once no lookup or scan still reads them. Only this
+     * thread adds runs below level 1, so the last level still holds
+     * exactly the runs that were merged.
+     */
+    for (int i = num_current; i < inputs.size(); i++) {
+        levels[next].runs.pop_back();
+    }
+
+    // A merge into the last level may have dropped every entry as deleted,
+    // while elsewhere a run may be left holding only range tombstones
+    if (output.size > 0 || !output.range_tombstones.empty()) {
+        levels[next].runs.push_front(make_shared<Run>(std::move(output)));
+    }
+
+    for (int i = 0; i < num_current; i++) {
+        levels[current].runs.pop_back();
+    }
+
+    // The runs holding the entries this merge dropped are gone, so the
+    // handles released so far may be taken by new records
+    if (value_log.enabled()) {
+        value_log.recycle();
+    }
+
+    latency_record(LATENCY_COMPACTION, start);
+}
+
+// Returns whether the runs of the current level can be moved into the next
+// level without merging: their key ranges must not overlap one another, nor,
+// when the next level is the last, those of its runs, which are kept free of
+// overlaps. Runs moving into the last level must also have no tombstones or
+// range tombstones, which only a merge drops. Called with the tree mutex held.
+bool LSMTree::is_trivial_move(int current, bool last) const {
+    vector<const Run *> inputs;
+
+    for (const auto& run : levels[current].runs) {
+        if (last && run->has_tombstones()) return false;
+        if (run->size > 0) inputs.push_back(run.get());
+    }
+
+    if (last) {
+        for (const auto& run : levels[current + 1].runs) {
+            if (run->size > 0) inputs.push_back(run.get());
+        }
+    }
+
+    sort(inputs.begin(), inputs.end(), [](const Run *a, const Run *b) {
+        return a->min_key() < b->min_key();
+    });
+
+    for (int i = 1; i < inputs.size(); i++) {
+        if (inputs[i - 1]->last_key() >= inputs[i]->min_key()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Returns the number of bytes in levels waiting to be merged down
+long LSMTree::pending_compaction_bytes(void) const {
+    long bytes = 0;
+
+    for (const auto& level : levels) {
+        if (level.remaining() <= 0) {
+            bytes += level.bytes();
+        }
+    }
+
+    return bytes;
+}
+
+// Applies backpressure after a flush when compaction is falling behind.
+// Past the hard limits writes wait for compactions to complete; past the
+// soft limits each flush is delayed as if written at the delayed write
+// rate, so that compaction can catch up. Writes only wait while some level
+// is due a merge: a hard run limit below the first level's capacity would
+// otherwise hold them for a compaction that never starts.
+void LSMTree::stall_writes(unique_lock<mutex>& lock) {
+    auto start = latency_start();
+    bool stalled = false;
+
+    while (!stopping && (levels.front().runs.size() >= stall_hard_runs
+                         || pending_compaction_bytes() >= stall_hard_bytes)
+           && pending_compaction_bytes() > 0) {
+        stalled = true;
+        compaction_cv.wait(lock);
+    }
+
+    if (levels.front().runs.size() >= stall_soft_runs
+        || pending_compaction_bytes() >= stall_soft_bytes) {
+        stalled = true;
+
+        lock.unlock();
+        this_thread::sleep_for(chrono::duration<double>(
+            (double)buffer.max_size * sizeof(entry_t) / STALL_DELAYED_WRITE_RATE));
+        lock.lock();
+    }
+
+    if (stalled) {
+        metric_add(METRIC_WRITE_STALLS);
+        metric_add(METRIC_WRITE_STALL_MICROS, chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - start).count());
+    }
+}
+
+// The put function inserts a key-value pair into the LSM tree.
+void LSMTree::put(KEY_t key, VAL_t val) {
+    auto start = latency_start();
+
+    if (value_log.enabled()) {
+        die("Trees with a value log only take values put into the log.");
+    }
+
+    insert(key, val);
+    latency_record(LATENCY_PUT, start);
+}
+
+// Combines an operand into the key's value with the merge operator, without
+// reading the key. The operand is combined with the key's older entries as
+// merges and reads come across them.
+void LSMTree::merge(KEY_t key, VAL_t operand) {
+    auto start = latency_start();
+
+    // Operands would be combined with value log handles
+    if (value_log.enabled()) {
+        die("Trees with a value log do not support merges.");
+    }
+
+    metric_add(METRIC_MERGES);
+    insert(key, operand, true);
+    latency_record(LATENCY_MERGE, start);
+}
+
+// The insert function adds a key-value pair, a tombstone, or a merge
+// operand if operand is set, to the buffer. A full buffer is swapped out
+// for an empty one to take the key, once any flush in progress has
+// finished, and then flushed into level 1.
+void LSMTree::insert(KEY_t key, VAL_t val, bool operand) {
+    unique_lock<mutex> lock(tree_mutex);
+    bool frozen;
+
+    metric_add(METRIC_PUTS);
+
+    frozen = false;
+
+    while (!(operand ? buffer.merge(key, val, merge_op) : buffer_put(key, val))) {
+        if (flush_in_progress) {
+            compaction_cv.wait(lock);
+        } else {
+            freeze_buffer();
+            frozen = true;
+        }
+    }
+
+    // Cached lookups of the key are now stale
+    if (row_cache.enabled()) {
+        row_cache.erase(key);
+    }
+
+    // The key is in before the flush and any stall, so that puts made
+    // while the mutex is released find room in the buffer
+    if (frozen) {
+        flush_frozen(lock);
+        stall_writes(lock);
+    }
+}
+
+// Puts a key into the buffer, releasing the value log record of the
+// buffered entry it overwrites, and returns false if the buffer is full.
+// Called with the tree mutex held.
+bool LSMTree::buffer_put(KEY_t key, VAL_t val) {
+    VAL_t buffered;
+    bool overwrites;
+
+    overwrites = value_log.enabled() && buffer.get(key, buffered) && buffered != VAL_TOMBSTONE;
+
+    if (!buffer.put(key, val)) {
+        return false;
+    }
+
+    if (overwrites) {
+        value_log.release(buffered);
+    }
+
+    return true;
+}
+
+// Puts entries into the buffer until it is full, returning the number
+// put. Entries with distinct keys in ascending key order are put in a
+// single pass if sorted is set. Called with the tree mutex held.
+long LSMTree::put_entries(const entry_t *entries, long num_entries, bool sorted) {
+    long inserted;
+
+    if (sorted && !value_log.enabled()) {
+        inserted = buffer.put_sorted(entries, num_entries);
+    } else {
+        for (inserted = 0; inserted < num_entries; inserted++) {
+            if (!buffer_put(entries[inserted].key, entries[inserted].val)) break;
+        }
+    }
+
+    // Cached lookups of the keys are now stale
+    if (row_cache.enabled()) {
+        for (long i = 0; i < inserted; i++) {
+            row_cache.erase(entries[i].key);
+        }
+    }
+
+    return inserted;
+}
+
+// Applies a batch of puts and deletes atomically: a batch that fits in the
+// buffer is put under a single hold of the tree mutex, swapping the buffer
+// out once if it fills up, so no lookup or scan sees part of it. A larger
+// batch fills the buffer more than once, and the parts it has flushed are
+// seen before the rest. Writes are only stalled once the whole batch is
+// in. Large batches are sorted first, which drops overwritten writes and
+// lets the buffer take them in key order.
+void LSMTree::write(const WriteBatch& batch) {
+    auto start = latency_start();
+    tree_scratch& scratch = thread_scratch();
+    const entry_t *entries;
+    long num_entries, inserted;
+    bool sorted, frozen;
+
+    if (batch.empty()) {
+        return;
+    }
+
+    // Batches may delete keys of a tree with a value log, but not put them
+    if (value_log.enabled() && batch.deletes() < batch.size()) {
+        die("Trees with a value log only take values put into the log.");
+    }
+
+    sorted = batch.size() >= WRITE_BATCH_SORT_MIN_ENTRIES;
+
+    if (sorted) {
+        batch.sort(scratch.batch);
+        entries = scratch.batch.data();
+        num_entries = scratch.batch.size();
+    } else {
+        entries = batch.entries().data();
+        num_entries = batch.size();
+    }
+
+    unique_lock<mutex> lock(tree_mutex);
+
+    metric_add(METRIC_WRITE_BATCHES);
+    metric_add(METRIC_PUTS, batch.size());
+    metric_add(METRIC_DELETES, batch.deletes());
+
+    // A batch that may fill the buffer waits for any flush in progress, so
+    // that it can swap the buffer out without releasing the mutex
+    while (flush_in_progress && num_entries > buffer.max_size - buffer.size()) {
+        compaction_cv.wait(lock);
+    }
+
+    frozen = false;
+
+    while ((inserted = put_entries(entries, num_entries, sorted)) < num_entries) {
+        entries += inserted;
+        num_entries -= inserted;
+
+        if (frozen) {
+            flush_frozen(lock);
+            frozen = false;
+        } else if (flush_in_progress) {
+            compaction_cv.wait(lock);
+        } else {
+            freeze_buffer();
+            frozen = true;
+        }
+    }
+
+    if (frozen) {
+        flush_frozen(lock);
+        stall_writes(lock);
+    }
+
+    lock.unlock();
+    latency_record(LATENCY_WRITE_BATCH, start);
+}
+
+// Writes the buffer's entries out as a new run at the front of the first
+// level, first waiting for any flush in progress, and leaves the buffer
+// empty. Called with the tree mutex held, which is released meanwhile.
+void LSMTree::flush_buffer(unique_lock<mutex>& lock) {
+    while (flush_in_progress) {
+        compaction_cv.wait(lock);
+    }
+
+    if (buffer.size() > 0 || !buffer.range_tombstones().empty()) {
+        freeze_buffer();
+        flush_frozen(lock);
+    }
+}
+
+// Swaps the full buffer out for the empty one, to be written out by
+// flush_frozen. Lookups and scans search both buffers until then. Called
+// with the tree mutex held while no flush is in progress.
+void LSMTree::freeze_buffer(void) {
+    assert(!flush_in_progress);
+
+    swap(buffer, flushing);
+    flush_in_progress = true;
+    flushes++;
+}
+
+/*
+ * Writes the frozen buffer out as a new run, and adds it to the front of
+ * the first level. The run is written with the tree mutex released, since
+ * its writes are paced by the compaction rate limiter: reads and puts into
+ * the other buffer go on meanwhile. Only reads and this flush use the
+ * frozen buffer, which none of them change. Called with the tree mutex
+ * held.
+ */
+void LSMTree::flush_frozen(unique_lock<mutex>& lock) {
+    auto start = latency_start();
+    long max_run_size = levels.front().max_run_size;
+
+    lock.unlock();
+
+    // Create a new run for the first level to store the buffer's entries
+    Run run(max_run_size, bf_bits_per_entry, rf_bits_per_entry, filter);
+    run.open_write(flushing.size(), false);
+
+    // Iterate through the buffer's entries in key order and insert them into the new run
+    unique_lock<mutex> workers(worker_mutex);
+    const vector<entry_t>& entries = flushing.sorted(&worker_pool);
+    workers.unlock();
+
+    for (const auto& entry : entries) {
+        run.put(entry, flushing.is_operand(entry.key));
+    }
+
+    // Write out the newly created run, along with the buffer's range
+    // tombstones, and add it to the first level
+    run.close_write();
+    run.range_tombstones = flushing.range_tombstones();
+    if (!run.range_tombstones.empty() && run.oldest_tombstone == 0) {
+        run.oldest_tombstone = time(nullptr);
+    }
+
+    metric_add(METRIC_BYTES_FLUSHED, run.size * sizeof(entry_t));
+
+    lock.lock();
+    levels.front().runs.push_front(make_shared<Run>(std::move(run)));
+    flushing.empty();
+    flush_in_progress = false;
+    latency_record(LATENCY_FLUSH, start);
+
+    // Let the compaction thread merge the first level down if it's full,
+    // and writers waiting for the flush go on
+    compaction_cv.notify_all();
+}
+
+/*
+ * LSMTree::lookup function retrieves the value associated with a given key.
+ *
+ * Parameters:
+ * - KEY_t key: the key for which the associated value should be retrieved.
+ * - VAL_t& val: receives the value if the key is found.
+ *
+ * Steps:
+ * 1. Search the buffer, then the buffer being flushed, if any, for the key
+ *    and return its value if found, unless it is a merge operand, then the
+ *    row cache, if enabled, for the outcome of an earlier lookup.
+ * 2. Probe the fence pointers and bloom filters of every run inline, newest
+ *    first, to collect the runs that may contain the key. No pages are read.
+ *    The tree mutex is held up to here, and released for the page reads.
+ * 3. Read the candidate runs' pages, sequentially newest-first when there are
+ *    only a few candidates. Otherwise submit all of the page reads at once
+ *    when the I/O queue is asynchronous, or fan them out over the worker pool.
+ * 4. If the newest entry found is a merge operand, read the older candidates
+ *    in turn and combine their entries into it until a value is reached.
+ * 5. Return whether a live (non-tombstone) value was found.
+ *
+ * Candidates and pages are kept in the thread's reused scratch space, so
+ * apart from the worker pool fan-out a lookup does not allocate.
+ */
+bool LSMTree::lookup(KEY_t key, VAL_t& val) {
+    auto start = latency_start();
+    bool found;
+
+    found = search(key, val);
+    latency_record(found ? LATENCY_GET_HIT : LATENCY_GET_MISS, start);
+
+    return found;
+}
+
+// The search function implements lookup, without timing it.
+bool LSMTree::search(KEY_t key, VAL_t& val) {
+    tree_scratch& scratch = thread_scratch();
+    vector<shared_ptr<Run>>& candidates = scratch.candidates;
+    vector<int>& candidate_levels = scratch.candidate_levels;
+    const Buffer *buffers[] = {&buffer, &flushing};
+    VAL_t latest_val, current_val, buffered_operand;
+    atomic<int> latest_run; // Read by the workers' early exit
+    merge_operator op;
+    long flush_count;
+    bool deleted, operand, caching;
+    SpinLock lock;
+    atomic<int> counter;
+
+    unique_lock<mutex> guard(tree_mutex);
+
+    metric_add(METRIC_GETS);
+
+    // Step 1: Search the buffers, newest first, then the row cache. Merge
+    // operands in the buffers are combined until a value or tombstone ends
+    // the key's history. Otherwise they still need the key's value from the
+    // runs, which is not cached since the operands will be flushed into them.
+    operand = false;
+
+    for (int i = 0; i < (flush_in_progress ? 2 : 1); i++) {
+        if (buffers[i]->get(key, current_val)) {
+            if (!buffers[i]->is_operand(key)) {
+                if (!operand) {
+                    val = current_val;
+                    return val != VAL_TOMBSTONE;
+                }
+
+                val = current_val == VAL_TOMBSTONE ? buffered_operand : merge_op(current_val, buffered_operand);
+                return true;
+            }
+
+            buffered_operand = operand ? merge_op(current_val, buffered_operand) : current_val;
+            operand = true;
+        }
+
+        if (buffers[i]->range_tombstones().covers(key)) {
+            if (operand) {
+                val = buffered_operand;
+            }
+
+            return operand;
+        }
+    }
+
+    caching = row_cache.enabled() && !operand;
+
+    if (caching) {
+        if (row_cache.get(key, val)) {
+            metric_add(METRIC_ROW_CACHE_HITS);
+            return val != VAL_TOMBSTONE;
+        }
+
+        metric_add(METRIC_ROW_CACHE_MISSES);
+    }
+
+    // Step 2: Collect candidate runs, ordered from newest to oldest, up to
+    // the first run holding a range tombstone that deletes the key from
+    // every older run
+    candidates.clear();
+    candidate_levels.clear();
+    deleted = false;
+
+    for (int i = 0; i < levels.size() && !deleted; i++) {
+        for (const auto& run : levels[i].runs) {
+            if (run->in_bounds(key)) {
+                metric_add(i, LEVEL_FILTER_PROBES);
+
+                if (run->may_contain(key)) {
+                    candidates.push_back(run);
+                    candidate_levels.push_back(i);
+                }
+            }
+
+            if (run->range_tombstones.covers(key)) {
+                deleted = true;
+                break;
+            }
+        }
+    }
+
+    op = merge_op;
+    flush_count = flushes;
+    guard.unlock();
+
+    latest_run = -1;
+
+    // Step 3: Read the candidates' pages
+    if (candidates.size() < PARALLEL_GET_MIN_CANDIDATES) {
+        // With few candidates the cost of waking the workers outweighs the
+        // page reads, so probe newest-first and stop at the first hit.
+        for (int i = 0; i < candidates.size() && latest_run < 0; i++) {
+            if (candidates[i]->lookup(key, latest_val)) {
+                latest_run = i;
+            } else {
+                metric_add(candidate_levels[i], LEVEL_FILTER_FALSE_POSITIVES);
+            }
+        }
+    } else if (io_queue().is_async()) {
+        // An asynchronous queue can keep every candidate's page read in
+        // flight from this thread, so there is no need to wake the workers.
+        IOQueue& io = io_queue();
+
+        scratch.pages.resize(candidates.size() * PAGE_ENTRIES);
+        scratch.page_sizes.resize(candidates.size());
+
+        for (int i = 0; i < candidates.size(); i++) {
+            scratch.page_sizes[i] = candidates[i]->queue_lookup(key, io, &scratch.pages[i * PAGE_ENTRIES]);
+        }
+
+        io.wait_all();
+
+        for (int i = 0; i < candidates.size(); i++) {
+            if (Run::search_page(&scratch.pages[i * PAGE_ENTRIES], scratch.page_sizes[i], key, current_val)) {
+                if (latest_run < 0) {
+                    latest_run = i;
+                    latest_val = current_val;
+                }
+            } else {
+                metric_add(candidate_levels[i], LEVEL_FILTER_FALSE_POSITIVES);
+            }
+        }
+    } else {
+        counter = 0;
+
+        worker_task search = [&] {
+            int current_run;
+            VAL_t current_val;
+
+            // Candidates are handed out in order, so once a hit has been
+            // recorded every run claimed afterwards is older and can be
+            // skipped.
+            while (latest_run < 0
+                   && (current_run = counter++) < candidates.size()) {
+                if (candidates[current_run]->lookup(key, current_val)) {
+                    // Keep the value from the most recent run
+                    lock.lock();
+
+                    if (latest_run < 0 || current_run < latest_run) {
+                        latest_run = current_run;
+                        latest_val = current_val;
+                    }
+
+                    lock.unlock();
+                } else {
+                    metric_add(candidate_levels[current_run], LEVEL_FILTER_FALSE_POSITIVES);
+                }
+            }
+        };
+
+        lock_guard<mutex> workers(worker_mutex);
+        worker_pool.launch(search);
+        worker_pool.wait_all();
+    }
+
+    // Step 4: Combine a merge operand with the older entries of its key,
+    // newest first, until a value or tombstone is found
+    if (latest_run >= 0 && candidates[latest_run]->is_operand(key)) {
+        for (int i = latest_run + 1; i < candidates.size(); i++) {
+            if (!candidates[i]->lookup(key, current_val)) {
+                continue;
+            } else if (current_val == VAL_TOMBSTONE) {
+                break;
+            }
+
+            latest_val = op(current_val, latest_val);
+
+            if (!candidates[i]->is_operand(key)) {
+                break;
+            }
+        }
+    }
+
+    scratch.release();
+
+    // Step 5: Report whether a live value was found
+    if (latest_run < 0) {
+        latest_val = VAL_TOMBSTONE;
+    }
+
+    if (operand) {
+        val = latest_val == VAL_TOMBSTONE ? buffered_operand : op(latest_val, buffered_operand);
+        return true;
+    }
+
+    // The outcome is only cached if the key has not been written since the
+    // runs were picked, which would have left it in the buffer, or in a run
+    // flushed since
+    if (caching) {
+        guard.lock();
+
+        if (flushes == flush_count && !buffer.get(key, current_val)
+            && !buffer.range_tombstones().covers(key)) {
+            row_cache.insert(key, latest_val);
+        }
+
+        guard.unlock();
+    }
+
+    if (latest_val == VAL_TOMBSTONE) {
+        return false;
+    }
+
+    val = latest_val;
+    return true;
+}
+
+// The get function outputs the value associated with a key, or an empty
+// line if the key is not found.
+void LSMTree::get(KEY_t key, ResultWriter& output) {
+    VAL_t val;
+    bool found;
+
+    found = lookup(key, val);
+    output.value(found, val);
+}
+
+// Appends a value to the value log and puts the key with its handle
+void LSMTree::put_blob(KEY_t key, const string& value) {
+    auto start = latency_start();
+
+    if (!value_log.enabled()) {
+        die("Values can only be put with a value log.");
+    }
+
+    insert(key, value_log.append(key, value));
+    latency_record(LATENCY_PUT, start);
+}
+
+// Looks up the key's handle and reads its value from the value log,
+// returning whether the key was found. A write may release the handle
+// between the lookup and the read, in which case a newer entry for the key
+// has replaced it and the lookup is repeated. The handle may even have
+// been reused since, which the read tells from the key: reused for this
+// key it holds the newer value, and for another it reads as released.
+// Handles are only released once replaced, so a lookup that returns the
+// released handle again has nothing newer to find.
+bool LSMTree::get_blob(KEY_t key, string& value) {
+    VAL_t handle, released;
+    bool retried;
+
+    if (!value_log.enabled()) {
+        die("Values can only be read with a value log.");
+    }
+
+    retried = false;
+
+    while (lookup(key, handle)) {
+        if (value_log.read(key, handle, value)) {
+            return true;
+        }
+
+        if (retried && handle == released) {
+            return false;
+        }
+
+        released = handle;
+        retried = true;
+    }
+
+    return false;
+}
+
+/*
+ * LSMTree::scan function appends the live key-value pairs in [start, end)
+ * to the caller's vector, in key order.
+ *
+ * The per-run subranges are gathered into the thread's reused scratch
+ * vectors, one slot per run, so the workers never contend for a shared
+ * container.
+ */
+void LSMTree::scan(KEY_t start, KEY_t end, vector<entry_t>& result) {
+    tree_scratch& scratch = thread_scratch();
+    auto start_time = latency_start();
+    merge_operator op;
+    entry_t entry;
+    int num_runs;
+
+    metric_add(METRIC_RANGES);
+
+    // Check if the range is valid, if not, there is nothing to add
+    if (end <= start) {
+        latency_record(LATENCY_RANGE, start_time);
+        return;
+    } else {
+        // Convert to inclusive bound
+        end -= 1;
+    }
+
+    unique_lock<mutex> lock(tree_mutex);
+    op = merge_op;
+    num_runs = read_range(start, end, scratch, lock);
+
+    /*
+     * Merge the resulting ranges from both buffers and runs using MergeContext.
+     * This step is performed to combine the results in the correct order.
+     */
+    scratch.merge.set_merge_operator(&op);
+
+    for (int i = 0; i <= num_runs; i++) {
+        scratch.merge.add(scratch.results[i].data(), scratch.results[i].size(), nullptr,
+                          i == 0 ? &scratch.buffer_operands : &scratch.candidates[i - 1]->operand_keys);
+    }
+
+    // Collect the merged key-value pairs, excluding tombstones (deleted keys)
+    while (!scratch.merge.done()) {
+        entry = scratch.merge.next();
+        if (entry.val != VAL_TOMBSTONE) {
+            result.push_back(entry);
+        }
+    }
+
+    scratch.release();
+    latency_record(LATENCY_RANGE, start_time);
+}
+
+// Folds the live values in [start, end) into agg. The subranges of the
+// buffers and runs are read as for a scan, but their entries are never
+// copied out: a lone subrange is folded in place, and otherwise the merged
+// values are gathered into a small reusable chunk that is folded each time
+// it fills up.
+void LSMTree::aggregate(KEY_t start, KEY_t end, RangeAggregate& agg) {
+    tree_scratch& scratch = thread_scratch();
+    auto start_time = latency_start();
+    merge_operator op;
+    entry_t entry;
+    int num_runs, num_sources, source;
+    long num_values;
+
+    metric_add(METRIC_RANGES);
+
+    if (end <= start) {
+        latency_record(LATENCY_RANGE, start_time);
+        return;
+    } else {
+        // Convert to inclusive bound
+        end -= 1;
+    }
+
+    unique_lock<mutex> lock(tree_mutex);
+    op = merge_op;
+    num_runs = read_range(start, end, scratch, lock);
+
+    // Find the sources that hold any entries in the range
+    num_sources = 0;
+    source = 0;
+
+    for (int i = 0; i <= num_runs; i++) {
+        if (!scratch.results[i].empty()) {
+            num_sources++;
+            source = i;
+        }
+    }
+
+    // With nothing to resolve between sources, fold the entries directly
+    if (num_sources <= 1) {
+        if (num_sources == 1) {
+            agg.add(scratch.results[source].data(), scratch.results[source].size());
+        }
+
+        scratch.release();
+        latency_record(LATENCY_RANGE, start_time);
+        return;
+    }
+
+    scratch.merge.set_merge_operator(&op);
+
+    for (int i = 0; i <= num_runs; i++) {
+        scratch.merge.add(scratch.results[i].data(), scratch.results[i].size(), nullptr,
+                          i == 0 ? &scratch.buffer_operands : &scratch.candidates[i - 1]->operand_keys);
+    }
+
+    scratch.values.resize(AGGREGATE_CHUNK_VALUES);
+    num_values = 0;
+
+    while (!scratch.merge.done()) {
+        entry = scratch.merge.next();
+
+        if (entry.val != VAL_TOMBSTONE) {
+            scratch.values[num_values++] = entry.val;
+
+            if (num_values == AGGREGATE_CHUNK_VALUES) {
+                agg.add(scratch.values.data(), num_values);
+                num_values = 0;
+            }
+        }
+    }
+
+    agg.add(scratch.values.data(), num_values);
+
+    scratch.release();
+    latency_record(LATENCY_RANGE, start_time);
+}
+
+// Reads the subranges of [start, end] held by the buffers and by each run
+// that may overlap it into the scratch results, returning the number of
+// runs. Slot 0 holds the buffers' subrange, and slot i + 1 that of the ith
+// run, newest first, less any entries deleted by range tombstones. Must be
+// called with the tree mutex held, which is released once the runs have
+// been picked.
+int LSMTree::read_range(KEY_t start, KEY_t end, tree_scratch& scratch, unique_lock<mutex>& lock) {
+    vector<vector<entry_t>>& results = scratch.results;
+    atomic<int> counter;
+    int num_runs;
+
+    collect_range_candidates(start, end, scratch);
+    num_runs = scratch.candidates.size();
+
+    // Slot 0 holds the buffers' subrange, and slot i + 1 that of candidate i
+    if (results.size() < num_runs + 1) {
+        results.resize(num_runs + 1);
+    }
+
+    for (auto& subrange : results) {
+        subrange.clear();
+    }
+
+    /*
+     * Search the buffers for the specified range. They have the highest
+     * priority (i.e., the most recent data) when merging the results later
+     */
+    read_buffers(start, end, scratch);
+    lock.unlock();
+
+    /*
+     * Prepare a worker task for searching runs for the specified range.
+     * The worker task will be executed in parallel using worker threads.
+     */
+    counter = 0;
+
+    worker_task search = [&] {
+        int current_run;
+
+        // Keep taking the next candidate to be searched while any remain,
+        // and drop the entries deleted by newer range tombstones
+        while ((current_run = counter++) < num_runs) {
+            scratch.candidates[current_run]->range(start, end, results[current_run + 1]);
+            scratch.covering[current_run].remove_covered(results[current_run + 1]);
+        }
+    };
+
+    if (num_runs > 1) {
+        // Launch the parallel search using worker threads
+        lock_guard<mutex> workers(worker_mutex);
+        worker_pool.launch(search);
+        // Wait for all worker threads to complete their tasks
+        worker_pool.wait_all();
+    } else {
+        // A single run isn't worth waking the workers for
+        search();
+    }
+
+    return num_runs;
+}
 
-    // Check if the iterator is within the bounds of the levels vector
-    assert(current >= levels.begin());
+// Reads the subrange [start, end] of the buffer, and of the buffer being
+// flushed if any, into the scratch results' slot 0, as a single source
+// newer than every run, with the keys of its merge operands in
+// buffer_operands. The buffer's range tombstones delete the flushing
+// buffer's entries, and the buffer's entries replace them, or are
+// combined with them if they are merge operands. Called with the tree
+// mutex held.
+void LSMTree::read_buffers(KEY_t start, KEY_t end, tree_scratch& scratch) {
+    vector<entry_t>& subrange = scratch.results[0];
+    vector<entry_t>& older = scratch.flushing_range;
+    vector<entry_t>& combined = scratch.buffers_range;
+    vector<KEY_t>& operands = scratch.buffer_operands;
+    long i, j;
+
+    subrange.clear();
+    operands.clear();
+    buffer.range(start, end, subrange);
+
+    if (flush_in_progress) {
+        older.clear();
+        flushing.range(start, end, older);
+        buffer.range_tombstones().remove_covered(older);
+    }
+
+    if (!flush_in_progress || older.empty()) {
+        if (buffer.has_operands()) {
+            for (const auto& entry : subrange) {
+                if (buffer.is_operand(entry.key)) {
+                    operands.push_back(entry.key);
+                }
+            }
+        }
 
-    // If there is remaining space in the current level, no need to merge
-    if (current->remaining() > 0) {
         return;
     }
-    // If the current level is the last one, there is no more space to merge down
-    else if (current >= levels.end() - 1) {
-        die("No more space in tree.");
-    }
-    // Otherwise, set the next level as the target for merging
-    else {
-        next = current + 1;
-    }
 
-    /*
-     * If the next level does not have space for the current level,
-     * recursively merge the next level downwards to create some
-     */
-    if (next->remaining() == 0) {
-        merge_down(next);
-        assert(next->remaining() > 0);
-    }
+    // Walk both subranges together in key order
+    combined.clear();
+    i = j = 0;
 
-    /*
-     * Merge all runs in the current level into the first
-     * run in the next level
-     */
-    for (auto& run : current->runs) {
-        merge_ctx.add(run.map_read(), run.size);
-    }
+    while (i < subrange.size() || j < older.size()) {
+        if (j == older.size() || (i < subrange.size() && subrange[i].key < older[j].key)) {
+            combined.push_back(subrange[i++]);
 
-    // Create a new run in the next level to store the merged entries
-    next->runs.emplace_front(next->max_run_size, bf_bits_per_entry);
-    next->runs.front().map_write();
+            if (buffer.is_operand(combined.back().key)) {
+                operands.push_back(combined.back().key);
+            }
+        } else if (i == subrange.size() || older[j].key < subrange[i].key) {
+            combined.push_back(older[j++]);
 
-    // Iterate through the merged entries and insert them into the new run
-    while (!merge_ctx.done()) {
-        entry = merge_ctx.next();
+            if (flushing.is_operand(combined.back().key)) {
+                operands.push_back(combined.back().key);
+            }
+        } else {
+            // A newer operand is combined with the older entry, whose value
+            // or tombstone ends the key's history unless it is an operand too
+            combined.push_back(subrange[i]);
 
-        // If we're not in the final level and the entry is not a tombstone,
-        // insert it into the next level's run
-        if (!(next == levels.end() - 1 && entry.val == VAL_TOMBSTONE)) {
-            next->runs.front().put(entry);
-        }
-    }
+            if (buffer.is_operand(subrange[i].key) && older[j].val != VAL_TOMBSTONE) {
+                combined.back().val = merge_op(older[j].val, subrange[i].val);
 
-    // Unmap the newly created run in the next level
-    next->runs.front().unmap();
+                if (flushing.is_operand(older[j].key)) {
+                    operands.push_back(older[j].key);
+                }
+            }
 
-    // Unmap the runs in the current level
-    for (auto& run : current->runs) {
-        run.unmap();
+            i++;
+            j++;
+        }
     }
 
-    /*
-     * Clear the current level to delete the old (now
-     * redundant) entry files.
-     */
-    current->runs.clear();
+    subrange.swap(combined);
 }
 
-// The put function inserts a key-value pair into the LSM tree.
-void LSMTree::put(KEY_t key, VAL_t val) {
-    /*
-     * Insert the key into the buffer and check if the buffer is full
-     */
-    bool bufferFull = !buffer.put(key, val);
+// Appends at most limit of the live entries in [start, end) to result,
+// starting from the smallest key, or from the largest in descending key
+// order if reverse is set. A negative limit means no limit.
+//
+// Limited scans walk each candidate run with a RunCursor instead of
+// reading its whole subrange, and stop reading pages from every run as
+// soon as limit entries have been found.
+void LSMTree::scan(KEY_t start, KEY_t end, long limit, bool reverse, vector<entry_t>& result) {
+    tree_scratch& scratch = thread_scratch();
+    deque<RunCursor>& cursors = scratch.cursors;
+    IOQueue& io = io_queue();
+    merge_operator op;
+    long first, found, buffer_position;
+    entry_t entry;
+    int i, source;
+    bool operand;
+
+    // Unlimited scans read the whole range anyway, so use the parallel path
+    if (limit < 0) {
+        first = result.size();
+        scan(start, end, result);
+
+        if (reverse) {
+            std::reverse(result.begin() + first, result.end());
+        }
 
-    // If the buffer is not full, return
-    if (!bufferFull) {
         return;
     }
 
-    // Merge down the runs in the first level if it's full
-    merge_down(levels.begin());
+    auto start_time = latency_start();
 
-    // Create a new run in the first level to store the buffer's entries
-    levels.front().runs.emplace_front(levels.front().max_run_size, bf_bits_per_entry);
-    levels.front().runs.front().map_write();
+    metric_add(METRIC_RANGES);
 
-    // Iterate through the buffer's entries and insert them into the new run
-    for (const auto& entry : buffer.entries) {
-        levels.front().runs.front().put(entry);
+    if (end <= start || limit == 0) {
+        latency_record(LATENCY_RANGE, start_time);
+        return;
+    } else {
+        // Convert to inclusive bound
+        end -= 1;
     }
 
-    // Unmap the newly created run in the first level
-    levels.front().runs.front().unmap();
+    unique_lock<mutex> lock(tree_mutex);
 
-    /*
-     * Empty the buffer and insert the key/value pair
-     */
+    collect_range_candidates(start, end, scratch);
 
-    // Empty the buffer
-    buffer.empty();
-    
-    // Insert the key-value pair into the now-empty buffer
-    assert(buffer.put(key, val));
-}
+    // Source 0 is the buffers' subrange, and source i + 1 candidate i's cursor
+    if (scratch.results.empty()) {
+        scratch.results.resize(1);
+    }
 
-// The get_run function retrieves the run at the specified index in the LSM tree.
-Run * LSMTree::get_run(int index) {
-    // Iterate through the levels of the LSM tree
-    for (const auto& level : levels) {
-        // If the index is within the current level's runs, return the run at that index
-        if (index < level.runs.size()) {
-            return (Run *) &level.runs[index];
-        } else {
-            // Otherwise, decrement the index by the current level's run size
-            // to search for the run in the subsequent levels
-            index -= level.runs.size();
-        }
+    read_buffers(start, end, scratch);
+    op = merge_op;
+    lock.unlock();
+
+    vector<entry_t>& buffered = scratch.results[0];
+
+    if (reverse) {
+        std::reverse(buffered.begin(), buffered.end());
     }
 
-    // If the function reaches this point, no run was found at the specified index
-    // Return a nullptr to indicate that the run was not found
-    return nullptr;
-};
+    cursors.clear();
 
-/*
- * LSMTree::get function retrieves the value associated with a given key.
- *
- * Parameters:
- * - KEY_t key: the key for which the associated value should be retrieved.
- *
- * Steps:
- * 1. Search the buffer for the key and return its value if found.
- * 2. If the key is not in the buffer, search for the key in the runs using multiple threads.
- * 3. If the key is found in a run, output the associated value.
- * 4. If the key is not found, output an empty line.
- */
-void LSMTree::get(KEY_t key) {
-    VAL_t *buffer_val;
-    VAL_t latest_val;
-    int latest_run;
-    SpinLock lock;
-    atomic<int> counter;
+    for (const auto& run : scratch.candidates) {
+        cursors.emplace_back(*run, start, end, reverse);
+        cursors.back().read(io);
+    }
 
-    // Step 1: Search buffer
-    buffer_val = buffer.get(key);
+    // The first batches of all runs are read together
+    io.wait_all();
 
-    if (buffer_val != nullptr) {
-        if (*buffer_val != VAL_TOMBSTONE) cout << *buffer_val;
-        cout << endl;
-        delete buffer_val;
-        return;
+    for (auto& cursor : cursors) {
+        cursor.begin(io);
     }
 
-    // Step 2: Search runs using multiple threads
-    counter = 0;
-    latest_run = -1;
+    buffer_position = 0;
 
-    worker_task search = [&] {
-        int current_run;
-        Run *run;
-        VAL_t *current_val;
-
-        current_run = counter++;
-
-        if (latest_run >= 0 || (run = get_run(current_run)) == nullptr) {
-            // Stop search if we discovered a key in another run, or
-            // if there are no more runs to search
-            return;
-        } else if ((current_val = run->get(key)) == nullptr) {
-            // Couldn't find the key in the current run, so we need
-            // to keep searching.
-            search();
-        } else {
-            // Update val if the run is more recent than the
-            // last, then stop searching since there's no need
-            // to search later runs.
-            lock.lock();
+    auto done = [&](int source) {
+        if (source == 0) return buffer_position == (long)buffered.size();
+        return cursors[source - 1].done();
+    };
 
-            if (latest_run < 0 || current_run < latest_run) {
-                latest_run = current_run;
-                latest_val = *current_val;
-            }
+    auto head = [&](int source) -> const entry_t& {
+        if (source == 0) return buffered[buffer_position];
+        return cursors[source - 1].head();
+    };
 
-            lock.unlock();
-            delete current_val;
-        }
+    auto advance = [&](int source) {
+        if (source == 0) buffer_position++;
+        else cursors[source - 1].advance(io);
     };
 
-    worker_pool.launch(search);
-    worker_pool.wait_all();
+    auto is_operand = [&](int source, KEY_t key) {
+        if (source == 0) {
+            return binary_search(scratch.buffer_operands.begin(), scratch.buffer_operands.end(), key);
+        }
+        return scratch.candidates[source - 1]->is_operand(key);
+    };
 
-    // Step 3: Output the associated value if the key is found
-    if (latest_run >= 0 && latest_val != VAL_TOMBSTONE) cout << latest_val;
-    
-    // Step 4: Output an empty line if the key is not found
-    cout << endl;
-}
+    // Orders sources by their next key in scan order, then newest first
+    auto after = [&](int a, int b) {
+        if (head(a).key != head(b).key) {
+            return reverse ? head(a).key < head(b).key : head(a).key > head(b).key;
+        }
+        return a > b;
+    };
 
-void LSMTree::range(KEY_t start, KEY_t end) {
-    // Declare variables needed for the range query
-    vector<entry_t> *buffer_range;
-    map<int, vector<entry_t> *> ranges;
-    SpinLock lock;
-    atomic<int> counter;
-    MergeContext merge_ctx;
-    entry_t entry;
+    priority_queue<int, vector<int>, decltype(after)> queue(after);
 
-    // Check if the range is valid, if not, print an empty line and return
-    if (end <= start) {
-        cout << endl;
-        return;
-    } else {
-        // Convert to inclusive bound
-        end -= 1;
+    for (i = 0; i <= (int)cursors.size(); i++) {
+        if (!done(i)) queue.push(i);
     }
 
-    /*
-     * Search buffer for the specified range and store the result in 'ranges'
-     * This is done by calling buffer.range(start, end) and inserting the result
-     * into the 'ranges' map with the key '0'. This indicates that the buffer has the highest priority 
-     * (i.e., the most recent data) when merging the results later
-     */
-    ranges.insert({0, buffer.range(start, end)});
+    // Take the newest version of each key in turn, skipping deleted keys
+    found = 0;
+
+    while (!queue.empty() && found < limit) {
+        source = queue.top();
+        entry = head(source);
+        operand = is_operand(source, entry.key);
+
+        while (!queue.empty() && head(queue.top()).key == entry.key) {
+            i = queue.top();
+            queue.pop();
+
+            // Combine older entries into a merge operand until a value,
+            // tombstone or range tombstone ends the key's history
+            if (i != source && operand) {
+                if (head(i).val == VAL_TOMBSTONE || scratch.covering[i - 1].covers(entry.key)) {
+                    operand = false;
+                } else {
+                    operand = is_operand(i, entry.key);
+                    entry.val = op(head(i).val, entry.val);
+                }
+            }
 
-    /*
-     * Prepare a worker task for searching runs for the specified range.
-     * The worker task will be executed in parallel using worker threads.
-     */
-    counter = 0;
+            advance(i);
+            if (!done(i)) queue.push(i);
+        }
 
-    worker_task search = [&] {
-        int current_run;
-        Run *run;
-
-        // Get the next run index to be searched
-        current_run = counter++;
-
-        // If the run exists, search the run for the specified range
-        if ((run = get_run(current_run)) != nullptr) {
-            // Lock the 'ranges' map to ensure thread safety
-            lock.lock();
-            // Insert the subrange result from the run into the 'ranges' map
-            ranges.insert({current_run + 1, run->range(start, end)});
-            // Unlock the 'ranges' map
-            lock.unlock();
-            // Continue searching for more runs if they exist
-            search();
+        // The newest version may itself be deleted by a newer range tombstone
+        if (entry.val != VAL_TOMBSTONE
+            && (source == 0 || !scratch.covering[source - 1].covers(entry.key))) {
+            result.push_back(entry);
+            found++;
         }
-    };
+    }
 
-    // Launch the parallel search using worker threads
-    worker_pool.launch(search);
-    // Wait for all worker threads to complete their tasks
-    worker_pool.wait_all();
+    scratch.release();
+    latency_record(LATENCY_RANGE, start_time);
+}
 
-    /*
-     * Merge the resulting ranges from both buffer and runs using MergeContext.
-     * This step is performed to combine the results in the correct order.
-     */
-    for (const auto& kv : ranges) {
-        merge_ctx.add(kv.second->data(), kv.second->size());
+// Collects the runs that may hold keys in [start, end] into the scratch
+// candidates, ordered from newest to oldest. Runs whose range filter rules
+// the range out are skipped without reading any of their pages. The range
+// tombstones of the buffers and of the runs newer than each candidate,
+// within the range, are gathered into the scratch covering, and runs that
+// lie wholly behind range tombstones are not collected at all. Called with
+// the tree mutex held.
+void LSMTree::collect_range_candidates(KEY_t start, KEY_t end, tree_scratch& scratch) {
+    vector<shared_ptr<Run>>& candidates = scratch.candidates;
+    vector<RangeTombstones>& covering = scratch.covering;
+    RangeTombstones& deleted = scratch.deleted;
+
+    candidates.clear();
+    deleted.clear();
+    deleted.add(buffer.range_tombstones(), start, end);
+
+    if (flush_in_progress) {
+        deleted.add(flushing.range_tombstones(), start, end);
     }
 
-    // Print the merged key-value pairs, excluding tombstones (deleted keys)
-    while (!merge_ctx.done()) {
-        entry = merge_ctx.next();
-        if (entry.val != VAL_TOMBSTONE) {
-            cout << entry.key << ":" << entry.val;
-            if (!merge_ctx.done()) cout << " ";
+    for (int i = 0; i < levels.size(); i++) {
+        for (const auto& run : levels[i].runs) {
+            if (deleted.covers(start, end)) {
+                return;
+            }
+
+            if (run->overlaps(start, end)) {
+                metric_add(i, LEVEL_RANGE_FILTER_PROBES);
+
+                if (run->may_overlap(start, end)) {
+                    if (covering.size() <= candidates.size()) {
+                        covering.resize(candidates.size() + 1);
+                    }
+
+                    covering[candidates.size()] = deleted;
+                    candidates.push_back(run);
+                } else {
+                    metric_add(i, LEVEL_RANGE_FILTER_SKIPS);
+                }
+            }
+
+            deleted.add(run->range_tombstones, start, end);
         }
     }
+}
 
-    // Print a newline character to indicate the end of the output
-    cout << endl;
+// The range function outputs the key-value pairs in [start, end) as a
+// single result.
+void LSMTree::range(KEY_t start, KEY_t end, ResultWriter& output) {
+    vector<entry_t>& entries = thread_scratch().output;
 
-    /*
-     * Cleanup subrange vectors by deallocating memory for each vector in 'ranges'
-     */
-    for (auto& range : ranges) {
-        delete range.second;
-    }
+    entries.clear();
+    scan(start, end, entries);
+    output.range(entries);
 }
 
 // Deletes a key-value pair from the LSM tree by inserting a tombstone value
 void LSMTree::del(KEY_t key) {
-    put(key, VAL_TOMBSTONE);
+    auto start = latency_start();
+
+    metric_add(METRIC_DELETES);
+    insert(key, VAL_TOMBSTONE);
+    latency_record(LATENCY_DELETE, start);
+}
+
+// Deletes the keys in [start, end) by recording a single range tombstone,
+// however many keys the range holds. The keys are dropped from the buffer
+// and the row cache, and the tombstone hides them in the runs until
+// merges carry it down to the last level.
+void LSMTree::delete_range(KEY_t start, KEY_t end) {
+    auto start_time = latency_start();
+
+    {
+        lock_guard<mutex> guard(tree_mutex);
+
+        metric_add(METRIC_RANGE_DELETES);
+
+        // Convert to inclusive bound
+        if (end > start) {
+            if (row_cache.enabled()) {
+                row_cache.erase_range(start, end - 1);
+            }
+
+            // The values of the buffered entries become garbage
+            if (value_log.enabled()) {
+                vector<entry_t> entries;
+
+                buffer.range(start, end - 1, entries);
+                for (const auto& entry : entries) {
+                    if (entry.val != VAL_TOMBSTONE) {
+                        value_log.release(entry.val);
+                    }
+                }
+            }
+
+            buffer.delete_range(start, end - 1);
+        }
+    }
+
+    latency_record(LATENCY_DELETE, start_time);
 }
 
-// Loads an LSM tree from a file
-void LSMTree::load(string file_path) {
+// Loads an LSM tree from a file, applying its entries in write batches.
+// Returns false if the file could not be opened.
+bool LSMTree::load(string file_path) {
     ifstream stream;
     entry_t entry;
+    WriteBatch batch;
     
     // Remove trailing quote from file_path, if present.
     if (!file_path.empty() && file_path.back() == '"') {
@@ -354,33 +1635,302 @@ void LSMTree::load(string file_path) {
     if (stream.is_open()) {
         // Iterate through all entries in the input file.
         while (stream >> entry) {
-            // For each entry, insert its key and value into the LSM tree.
-            put(entry.key, entry.val);
+            batch.put(entry.key, entry.val);
+
+            if (batch.size() == LOAD_BATCH_ENTRIES) {
+                write(batch);
+                batch.clear();
+            }
         }
+
+        write(batch);
+        return true;
     } else {
-        // If the input file stream could not be opened, print an error message and exit.
-        die("Could not locate file '" + file_path + "'.");
+        // If the input file stream could not be opened, leave the caller to report it.
+        return false;
+    }
+}
+
+/*
+ * Checkpoints
+ *
+ * Runs never change once written, so a checkpoint only needs to flush the
+ * buffer and hard-link the files of the live runs into the checkpoint
+ * directory, along with a manifest listing them by level. Opening a
+ * checkpoint links the files back in the same way, without copying data.
+ *
+ * Taking a checkpoint may fail on a bad path, or when the directory is on
+ * another file system than the runs, which the server must survive. The
+ * steps of a checkpoint report such failures with an error message rather
+ * than exiting, and record each file and directory they create, so that a
+ * failed checkpoint can be removed again.
+ */
+
+// Creates a checkpoint directory, which must not already hold a checkpoint
+bool make_checkpoint_dir(string dir, vector<string>& created, string& error) {
+    if (mkdir(dir.c_str(), 0755) == 0) {
+        created.push_back(dir);
+    } else if (errno != EEXIST) {
+        error = "Could not create checkpoint directory '" + dir + "': " + string(strerror(errno));
+        return false;
+    }
+
+    if (access((dir + "/" + CHECKPOINT_MANIFEST).c_str(), F_OK) == 0) {
+        error = "'" + dir + "' already holds a checkpoint.";
+        return false;
+    }
+
+    return true;
+}
+
+// Writes a manifest file, replacing it atomically once complete
+bool write_manifest(string dir, string contents, vector<string>& created, string& error) {
+    string path, tmp_path;
+    ofstream stream;
+
+    path = dir + "/" + CHECKPOINT_MANIFEST;
+    tmp_path = path + ".tmp";
+
+    stream.open(tmp_path);
+    stream << contents;
+    stream.close();
+
+    if (stream.fail() || rename(tmp_path.c_str(), path.c_str()) == -1) {
+        remove(tmp_path.c_str());
+        error = "Could not write manifest '" + path + "'.";
+        return false;
+    }
+
+    created.push_back(path);
+    return true;
+}
+
+// Removes what a failed checkpoint created, newest first, so that each
+// directory is empty by the time it is removed
+void remove_checkpoint(const vector<string>& created) {
+    for (auto it = created.rbegin(); it != created.rend(); it++) {
+        remove(it->c_str());
+    }
+}
+
+// Writes a vector of keys to a file in binary
+static bool write_keys(string path, const vector<KEY_t>& keys, string& error) {
+    ofstream stream(path, ofstream::binary);
+
+    stream.write((const char *)keys.data(), keys.size() * sizeof(KEY_t));
+    stream.close();
+
+    if (stream.fail()) {
+        remove(path.c_str());
+        error = "Could not write '" + path + "'.";
+        return false;
+    }
+
+    return true;
+}
+
+// Reads a number of keys written by write_keys
+static void read_keys(string path, long num_keys, vector<KEY_t>& keys) {
+    ifstream stream(path, ifstream::binary);
+
+    keys.resize(num_keys);
+    stream.read((char *)keys.data(), num_keys * sizeof(KEY_t));
+
+    if (!stream) {
+        die("Could not read '" + path + "'.");
+    }
+}
+
+// Flushes the buffer and links every live run into the directory. Runs
+// being merged by the compaction thread are still live until the merged
+// run is installed, so the checkpoint is consistent. Returns false with
+// an error message, leaving no checkpoint behind, if it fails.
+bool LSMTree::checkpoint(string dir, string& error) {
+    vector<string> created;
+
+    if (!checkpoint(dir, created, error)) {
+        remove_checkpoint(created);
+        return false;
+    }
+
+    return true;
+}
+
+// Takes a checkpoint, recording what it creates for the caller to remove
+// if this or a later step fails. The value log's table of handles is taken
+// along with the runs, but its records are copied once the tree is
+// unlocked again.
+bool LSMTree::checkpoint(string dir, vector<string>& created, string& error) {
+    unique_lock<mutex> lock(tree_mutex);
+    value_log_snapshot values;
+    ostringstream manifest;
+    string file;
+
+    if (!make_checkpoint_dir(dir, created, error)) {
+        return false;
+    }
+
+    // Writes made before the checkpoint are in the buffers, and in runs
+    // once they are flushed. Writes made meanwhile may be left out.
+    flush_buffer(lock);
+
+    manifest << CHECKPOINT_MAGIC << endl
+             << "levels " << levels.size() << endl;
+
+    for (int i = 0; i < levels.size(); i++) {
+        manifest << "level " << levels[i].runs.size() << endl;
+
+        for (int j = 0; j < levels[i].runs.size(); j++) {
+            const Run& run = *levels[i].runs[j];
+
+            file = "L" + to_string(i + 1) + "-" + to_string(j) + ".run";
+            if (!run.link_to(dir + "/" + file, error)) {
+                return false;
+            }
+
+            created.push_back(dir + "/" + file);
+            manifest << "run " << file << " " << run.size << " " << run.max_size
+                     << " " << run.range_tombstones.size();
+
+            for (const auto& range : run.range_tombstones.intervals()) {
+                manifest << " " << range.first << " " << range.second;
+            }
+
+            manifest << " " << run.operand_keys.size() << endl;
+
+            if (!run.operand_keys.empty()) {
+                if (!write_keys(dir + "/" + file + CHECKPOINT_OPERANDS_SUFFIX,
+                                run.operand_keys, error)) {
+                    return false;
+                }
+
+                created.push_back(dir + "/" + file + CHECKPOINT_OPERANDS_SUFFIX);
+            }
+        }
+    }
+
+    if (!value_log.enabled()) {
+        return write_manifest(dir, manifest.str(), created, error);
+    }
+
+    value_log.snapshot(values);
+    lock.unlock();
+
+    return ValueLog::copy_to(values, dir, created, error)
+        && write_manifest(dir, manifest.str(), created, error);
+}
+
+// Fills an empty tree with the runs of a checkpoint. The tree's shape may
+// differ from that of the checkpointed tree: levels are added as needed,
+// and over-full levels are merged down by the compaction thread.
+void LSMTree::open_checkpoint(string dir) {
+    lock_guard<mutex> guard(tree_mutex);
+    ifstream manifest;
+    string magic, word, file;
+    long num_levels, num_runs, size, max_size, num_ranges, num_operands;
+    KEY_t range_start, range_end;
+
+    for (const auto& level : levels) {
+        if (!level.runs.empty()) {
+            die("Checkpoints can only be opened into an empty tree.");
+        }
+    }
+
+    // Entries of a tree with a value log hold handles, which only mean
+    // something alongside the log
+    if (ValueLog::in_checkpoint(dir) != value_log.enabled()) {
+        die(value_log.enabled() ? "'" + dir + "' holds no value log."
+                                : "'" + dir + "' holds a value log, which the tree needs to be opened with.");
+    }
+
+    if (value_log.enabled()) {
+        value_log.copy_from(dir);
+    }
+
+    manifest.open(dir + "/" + CHECKPOINT_MANIFEST);
+    if (!manifest.is_open()) {
+        die("Could not open checkpoint '" + dir + "'.");
+    }
+
+    manifest >> magic >> word >> num_levels;
+    if (magic != CHECKPOINT_MAGIC || word != "levels") {
+        die("'" + dir + "' does not hold a tree checkpoint.");
+    }
+
+    for (int i = 0; i < num_levels; i++) {
+        manifest >> word >> num_runs;
+        if (word != "level") {
+            die("Corrupt checkpoint manifest in '" + dir + "'.");
+        }
+
+        while (num_runs > 0 && i >= levels.size()) {
+            add_level();
+        }
+
+        for (int j = 0; j < num_runs; j++) {
+            manifest >> word >> file >> size >> max_size;
+            if (word != "run" || manifest.fail()) {
+                die("Corrupt checkpoint manifest in '" + dir + "'.");
+            }
+
+            shared_ptr<Run> run = make_shared<Run>(max(max_size, levels[i].max_run_size),
+                                                   bf_bits_per_entry, rf_bits_per_entry, filter);
+            run->link_from(dir + "/" + file, size);
+
+            // Runs are followed by their range tombstones and the number of
+            // their merge operands
+            manifest >> num_ranges;
+
+            for (long k = 0; k < num_ranges; k++) {
+                manifest >> range_start >> range_end;
+                run->range_tombstones.add(range_start, range_end);
+            }
+
+            manifest >> num_operands;
+
+            if (manifest.fail()) {
+                die("Corrupt checkpoint manifest in '" + dir + "'.");
+            }
+
+            if (num_operands > 0) {
+                read_keys(dir + "/" + file + CHECKPOINT_OPERANDS_SUFFIX, num_operands, run->operand_keys);
+            }
+
+            if (!run->range_tombstones.empty() && run->oldest_tombstone == 0) {
+                run->oldest_tombstone = time(nullptr);
+            }
+
+            levels[i].runs.push_back(run);
+        }
     }
+
+    compaction_cv.notify_all();
 }
 
-void LSMTree::printStats() {
+void LSMTree::printStats(ostream& out) {
+    unique_lock<mutex> lock(tree_mutex);
     int logicalPairs = 0;
 
+    // Wait for the buffer being flushed to reach level 1
+    while (flush_in_progress) {
+        compaction_cv.wait(lock);
+    }
+
     // Print Logical Pairs per level.
     // This part of the function prints the number of valid key-value pairs
     // present in each level of the LSM tree.
-    cout << "Logical Pairs: ";
+    out << "Logical Pairs: ";
     for (int levelIdx = 0; levelIdx < levels.size(); levelIdx++) {
         Level& level = levels[levelIdx];
         int levelKeyCount = 0;
 
         // Iterate through all runs in the current level.
         // A level can have multiple runs, so we need to process each run.
-        for (const Run& run : level.runs) {
+        for (const auto& run : level.runs) {
             // Iterate through all entries in the current run.
             // Each run contains multiple entries, and we need to process
             // each entry individually to determine if it's a valid pair.
-            for (const entry_t& entry : run.entries) {
+            for (const entry_t& entry : run->entries) {
                 // If the entry's value is not a tombstone, increment the key count.
                 // Tombstone values are used to represent deleted keys,
                 // so they are not considered valid key-value pairs.
@@ -393,18 +1943,18 @@ void LSMTree::printStats() {
 
         // Print the key count for the current level.
         // This line outputs the number of valid key-value pairs in the current level.
-        cout << "LVL" << (levelIdx + 1) << ": " << levelKeyCount;
+        out << "LVL" << (levelIdx + 1) << ": " << levelKeyCount;
         if (levelIdx < levels.size() - 1) {
-            cout << ", ";
+            out << ", ";
         } else {
-            cout << endl;
+            out << endl;
         }
     }
 
     // Include buffer entries in the total logical pairs count.
     // The buffer contains key-value pairs that haven't been merged into the LSM tree yet,
     // so we need to count those as well.
-    for (const entry_t& entry : buffer.entries) {
+    for (const entry_t& entry : buffer.sorted(nullptr)) {
         if (entry.val != VAL_TOMBSTONE) {
             logicalPairs++;
         }
@@ -412,17 +1962,17 @@ void LSMTree::printStats() {
 
     // Print the total number of logical pairs.
     // This line outputs the combined total of valid key-value pairs across all levels and the buffer.
-    cout << "Total Logical Pairs: " << logicalPairs << endl;
+    out << "Total Logical Pairs: " << logicalPairs << endl;
 
     // Print the key, value, and level information for each entry in the LSM tree.
     // This part of the function iterates through each level and its runs in the LSM tree,
     // printing the key-value-level information for each non-tombstone entry.
     for (int levelIdx = 0; levelIdx < levels.size(); levelIdx++) {
         Level& level = levels[levelIdx];
-        for (const Run& run : level.runs) {
-            for (const entry_t& entry : run.entries) {
+        for (const auto& run : level.runs) {
+            for (const entry_t& entry : run->entries) {
                 if (entry.val != VAL_TOMBSTONE) {
-                    cout << entry.key << ":" << entry.val << ":L" << (levelIdx + 1) << " ";
+                    out << entry.key << ":" << entry.val << ":L" << (levelIdx + 1) << " ";
                 }
             }
         }
@@ -431,35 +1981,129 @@ void LSMTree::printStats() {
     // Print buffer entries.
     // This part of the function prints the key-value information for each non-tombstone
     // entry present in the buffer.
-    for (const entry_t& entry : buffer.entries) {
+    for (const entry_t& entry : buffer.sorted(nullptr)) {
         if (entry.val != VAL_TOMBSTONE) {
-            cout << entry.key << ":" << entry.val << ":Buffer ";
+            out << entry.key << ":" << entry.val << ":Buffer ";
         }
     }
-    cout << endl;
+    out << endl;
 
 }
 
-void LSMTree::put_metrics(string file_path) {
-    using namespace std::chrono;
+// Adds the shape of each level of the tree to summaries
+void LSMTree::summarize_levels(vector<level_summary>& summaries) {
+    lock_guard<mutex> guard(tree_mutex);
+
+    time_t oldest;
+
+    if (summaries.size() < levels.size()) {
+        summaries.resize(levels.size(), {0, 0, 0, 0});
+    }
+
+    for (int i = 0; i < levels.size(); i++) {
+        level_summary& summary = summaries[i];
+
+        summary.runs += levels[i].runs.size();
+        summary.entries += levels[i].entries();
+        summary.tombstones += levels[i].tombstones();
+
+        oldest = levels[i].oldest_tombstone();
+        if (oldest != 0 && (summary.oldest_tombstone == 0 || oldest < summary.oldest_tombstone)) {
+            summary.oldest_tombstone = oldest;
+        }
+    }
+}
 
-    // Write latency
-    auto start = high_resolution_clock::now();
-    load(file_path);
-    auto end = high_resolution_clock::now();
-    auto write_latency = duration_cast<microseconds>(end - start).count();
-    std::cout << "Write latency: " << write_latency << " us" << std::endl;
+void LSMTree::print_metrics(bool json, ostream& out) {
+    vector<level_summary> summaries;
 
+    summarize_levels(summaries);
+    print_tree_metrics(json, summaries, out);
 }
 
-void LSMTree::range_metrics(KEY_t start, KEY_t end) {
-    using namespace std::chrono;
+// Prints the metrics registry's counters along with the shape of the
+// tree, either as "name: value" lines or as a single JSON object.
+void print_tree_metrics(bool json, const vector<level_summary>& summaries, ostream& out) {
+    metrics_snapshot snapshot;
+    long bytes_written, bytes_ingested;
+    double write_amplification, row_cache_hit_rate, tombstone_density;
+    long row_cache_lookups, tombstone_age;
+    time_t now = time(nullptr);
+    int i, j;
+
+    collect_metrics(snapshot);
+
+    // Write amplification relates bytes written to run files to bytes put
+    bytes_ingested = snapshot.counters[METRIC_PUTS] * sizeof(entry_t);
+    bytes_written = snapshot.counters[METRIC_BYTES_FLUSHED]
+                  + snapshot.counters[METRIC_BYTES_COMPACTED];
+    write_amplification = bytes_ingested > 0 ? (double)bytes_written / bytes_ingested : 0;
+
+    row_cache_lookups = snapshot.counters[METRIC_ROW_CACHE_HITS]
+                      + snapshot.counters[METRIC_ROW_CACHE_MISSES];
+    row_cache_hit_rate = row_cache_lookups > 0
+                       ? (double)snapshot.counters[METRIC_ROW_CACHE_HITS] / row_cache_lookups : 0;
+
+    out << (json ? "{" : "");
+
+    for (i = 0; i < NUM_METRICS; i++) {
+        if (json) {
+            out << "\"" << metric_names[i] << "\":" << snapshot.counters[i] << ",";
+        } else {
+            out << metric_names[i] << ": " << snapshot.counters[i] << endl;
+        }
+    }
+
+    // Allocations are only counted in builds that pay for counting them
+#ifdef COUNT_ALLOCATIONS
+    if (json) {
+        out << "\"allocations\":" << allocation_count() << ",";
+    } else {
+        out << "allocations: " << allocation_count() << endl;
+    }
+#endif
+
+    if (json) {
+        out << "\"write_amplification\":" << write_amplification << ","
+             << "\"row_cache_hit_rate\":" << row_cache_hit_rate << ","
+             << "\"levels\":[";
+    } else {
+        out << "write_amplification: " << write_amplification << endl
+             << "row_cache_hit_rate: " << row_cache_hit_rate << endl;
+    }
 
-    // Read latency
-    auto start_time = high_resolution_clock::now();
-    range(start, end);
-    auto end_time = high_resolution_clock::now();
-    auto read_latency = duration_cast<microseconds>(end_time - start_time).count();
-    std::cout << "Read latency: " << read_latency << " us" << std::endl;
+    for (i = 0; i < summaries.size(); i++) {
+        const long *counters = snapshot.level_counters[min(i, METRICS_MAX_LEVELS - 1)];
+        const level_summary& summary = summaries[i];
+
+        tombstone_density = summary.entries > 0 ? (double)summary.tombstones / summary.entries : 0;
+        tombstone_age = summary.oldest_tombstone != 0 ? now - summary.oldest_tombstone : 0;
+
+        if (json) {
+            out << (i > 0 ? "," : "") << "{\"level\":" << i + 1
+                 << ",\"runs\":" << summary.runs
+                 << ",\"entries\":" << summary.entries
+                 << ",\"tombstones\":" << summary.tombstones
+                 << ",\"tombstone_density\":" << tombstone_density
+                 << ",\"oldest_tombstone_age\":" << tombstone_age;
+            for (j = 0; j < NUM_LEVEL_METRICS; j++) {
+                out << ",\"" << level_metric_names[j] << "\":" << counters[j];
+            }
+            out << "}";
+        } else {
+            out << "LVL" << i + 1 << ": runs: " << summary.runs
+                 << ", entries: " << summary.entries
+                 << ", tombstones: " << summary.tombstones
+                 << ", tombstone_density: " << tombstone_density
+                 << ", oldest_tombstone_age: " << tombstone_age;
+            for (j = 0; j < NUM_LEVEL_METRICS; j++) {
+                out << ", " << level_metric_names[j] << ": " << counters[j];
+            }
+            out << endl;
+        }
+    }
 
+    if (json) {
+        out << "]}" << endl;
+    }
 }
@@ -1,33 +1,174 @@
+#ifndef LSM_TREE_H
+#define LSM_TREE_H
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include "aggregate.h"
 #include "buffer.h"
 #include "level.h"
+#include "merge.h"
+#include "merge_operator.h"
+#include "result_writer.h"
+#include "row_cache.h"
 #include "spin_lock.h"
 #include "types.h"
+#include "value_log.h"
 #include "worker_pool.h"
+#include "write_batch.h"
 
-#define DEFAULT_TREE_DEPTH 5
+#define DEFAULT_TREE_DEPTH 1 // Levels are added as the tree grows
 #define DEFAULT_TREE_FANOUT 10
 #define DEFAULT_BUFFER_NUM_PAGES 1000
 #define DEFAULT_THREAD_COUNT 4
 #define DEFAULT_BF_BITS_PER_ENTRY 0.5
+#define DEFAULT_RF_BITS_PER_ENTRY 8
+#define DEFAULT_ROW_CACHE_ENTRIES 0
+
+// Number of entries of a load file applied as a single write batch
+#define LOAD_BATCH_ENTRIES 4096
+
+// Point lookups with fewer candidate runs than this (after the bloom
+// filters have been consulted) are served sequentially, newest run first,
+// instead of being fanned out over the worker pool.
+#define PARALLEL_GET_MIN_CANDIDATES 3
+
+// Write stall thresholds. Puts are slowed down once level 1 holds the soft
+// number of runs or compactions fall behind by the soft number of bytes,
+// and stopped altogether at the hard limits until compaction catches up.
+// Level 1 is compacted once it holds fanout runs.
+#define DEFAULT_STALL_SOFT_RUNS_FACTOR 2
+#define DEFAULT_STALL_HARD_RUNS_FACTOR 3
+#define DEFAULT_STALL_SOFT_PENDING_BYTES (64L << 20)
+#define DEFAULT_STALL_HARD_PENDING_BYTES (256L << 20)
+
+// Levels above the last are merged down, even if not full, once this share
+// of their entries are tombstones or their oldest tombstone is this many
+// seconds old, so that deleted space is reclaimed and scans stop wading
+// through tombstones. The compaction thread checks tombstone ages at least
+// every check interval.
+#define DEFAULT_TOMBSTONE_COMPACTION_DENSITY 0.5
+#define DEFAULT_TOMBSTONE_COMPACTION_AGE 600
+#define TOMBSTONE_CHECK_INTERVAL 1
+
+// Name of the file listing a checkpoint's contents, and its first line
+#define CHECKPOINT_MANIFEST "MANIFEST"
+#define CHECKPOINT_MAGIC "lsm-tree-checkpoint-1"
+
+// Suffix of the file holding the keys of a checkpointed run's merge operands
+#define CHECKPOINT_OPERANDS_SUFFIX ".operands"
+
+// Rate at which flushes are let through while writes are slowed down
+#define STALL_DELAYED_WRITE_RATE (16L << 20)
+
+// The shape of a level, summed over every tree that is summarised
+struct level_summary {
+    long runs;
+    long entries;
+    long tombstones;
+    time_t oldest_tombstone; // 0 if the level holds no tombstones
+};
+
+// Scratch space of a thread's lookups, scans and write batches, defined
+// with them
+struct tree_scratch;
 
 class LSMTree {
     Buffer buffer;
+    Buffer flushing; // The full buffer being written out, while flush_in_progress
     WorkerPool worker_pool;
     float bf_bits_per_entry;
-    vector<Level> levels;
-    Run * get_run(int);
-    void merge_down(vector<Level>::iterator);
+    float rf_bits_per_entry;
+    filter_type filter;
+    deque<Level> levels;
+    RowCache row_cache;
+    merge_operator merge_op;
+    ValueLog value_log;
+
+    // Runs are merged down by a background compaction thread. The mutex
+    // guards the buffers and levels. Foreground operations hold it while
+    // they use the buffers and pick runs, and the compaction thread while
+    // it picks or installs runs, but neither holds it while reading or
+    // writing runs.
+    mutex tree_mutex;
+    condition_variable compaction_cv;
+    thread compaction_thread;
+    bool stopping;
+    bool flush_in_progress;
+    long flushes; // Number of buffers swapped out for flushing
+    int stall_soft_runs, stall_hard_runs;
+    long stall_soft_bytes, stall_hard_bytes;
+    double tombstone_density;
+    long tombstone_age;
+
+    // Lets one thread at a time fan work out over the worker pool. The
+    // tree mutex is never taken while it is held.
+    mutex worker_mutex;
+
+    void insert(KEY_t, VAL_t, bool = false);
+    bool buffer_put(KEY_t, VAL_t);
+    long put_entries(const entry_t *, long, bool);
+    void flush_buffer(unique_lock<mutex>&);
+    void freeze_buffer(void);
+    void flush_frozen(unique_lock<mutex>&);
+    bool search(KEY_t, VAL_t&);
+    void read_buffers(KEY_t, KEY_t, tree_scratch&);
+    void collect_range_candidates(KEY_t, KEY_t, tree_scratch&);
+    int read_range(KEY_t, KEY_t, tree_scratch&, unique_lock<mutex>&);
+    void compaction_loop(void);
+    void add_level(void);
+    void compact(int, unique_lock<mutex>&);
+    bool is_trivial_move(int, bool) const;
+    int tombstone_compaction_level(void) const;
+    long pending_compaction_bytes(void) const;
+    void stall_writes(unique_lock<mutex>&);
 public:
-    LSMTree(int, int, int, int, float);
+    LSMTree(int, int, int, int, float, float, filter_type);
+    ~LSMTree(void);
+    void set_write_stall(int, int, long, long);
+    void set_tombstone_compaction(double, long);
+    void set_buffer_mode(buffer_mode);
+    void set_row_cache(long);
+    void set_merge_operator(merge_operator);
+    void set_value_log(std::string, double, long);
+    bool has_value_log(void) const {return value_log.enabled();}
     void put(KEY_t, VAL_t);
-    void get(KEY_t);
-    void range(KEY_t, KEY_t);
+    void write(const WriteBatch&);
+    void merge(KEY_t, VAL_t);
+    bool lookup(KEY_t, VAL_t&);
+    void get(KEY_t, ResultWriter&);
+    void put_blob(KEY_t, const std::string&);
+    bool get_blob(KEY_t, std::string&);
+    void scan(KEY_t, KEY_t, vector<entry_t>&);
+    void scan(KEY_t, KEY_t, long, bool, vector<entry_t>&);
+    void aggregate(KEY_t, KEY_t, RangeAggregate&);
+    void range(KEY_t, KEY_t, ResultWriter&);
     void del(KEY_t);
-    void load(std::string);
+    void delete_range(KEY_t, KEY_t);
+    bool load(std::string);
+    bool checkpoint(std::string, std::string&);
+    bool checkpoint(std::string, vector<std::string>&, std::string&);
+    void open_checkpoint(std::string);
 	void print_stats();
-    void printStats();
-    void put_metrics(std::string);
-    void range_metrics(KEY_t, KEY_t);
+    void printStats(ostream&);
+    void print_metrics(bool, ostream&);
+    void summarize_levels(vector<level_summary>&);
 };
+
+// Prints the process's metrics for a tree with the given level shapes
+void print_tree_metrics(bool, const vector<level_summary>&, ostream&);
+
+// Helpers shared by tree and sharded tree checkpoints
+bool make_checkpoint_dir(string, vector<string>&, string&);
+bool write_manifest(string, string, vector<string>&, string&);
+void remove_checkpoint(const vector<string>&);
+
+// Read and write entries in the binary format of load files
+ostream& operator<<(ostream&, const entry_t&);
+istream& operator>>(istream&, entry_t&);
+
+#endif
@@ -1,18 +1,62 @@
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 
+#include "histogram.h"
+#include "io.h"
 #include "lsm_tree.h"
+#include "rate_limiter.h"
+#include "result_writer.h"
+#include "server.h"
+#include "sharded_tree.h"
 #include "sys.h"
 #include "unistd.h"
 
 using namespace std;
 
-void command_loop(LSMTree& tree) {
+// Results still pending when the process exits, including on errors, are
+// written out by an exit handler. It runs inside exit(), so it must not
+// die on a write error and call exit() again.
+static ResultWriter *results;
+
+static void flush_results(void) {
+    ResultWriter *output = results;
+
+    results = nullptr;
+
+    if (output != nullptr) {
+        output->write_pending();
+    }
+}
+
+void command_loop(ShardedLSMTree& tree, ResultWriter& output) {
     char command;
     KEY_t key_a, key_b;
     VAL_t val;
-    string file_path;
+    long limit;
+    RangeAggregate agg;
+    ostringstream stream;
+    string file_path, value, error;
+
+    while (true) {
+        // Results are written out whenever the next command has yet to
+        // arrive, so that interactive clients see them, and otherwise only
+        // once enough of them are pending. The line break after the last
+        // command is skipped first, so it doesn't count as more input.
+        while (cin.rdbuf()->in_avail() > 0 && isspace(cin.rdbuf()->sgetc())) {
+            cin.rdbuf()->sbumpc();
+        }
+
+        if (cin.rdbuf()->in_avail() <= 0) {
+            output.flush();
+        }
+
+        if (!(cin >> command)) {
+            break;
+        }
 
-    while (cin >> command) {
         switch (command) {
         case 'p':
             cin >> key_a >> val;
@@ -23,37 +67,91 @@ void command_loop(LSMTree& tree) {
                 tree.put(key_a, val);
             }
 
+            break;
+        case 'm':
+            // Combine an operand into the key's value with the merge operator
+            cin >> key_a >> val;
+
+            if (val < VAL_MIN || val > VAL_MAX) {
+                die("Could not merge value " + to_string(val) + ": out of range.");
+            } else {
+                tree.merge(key_a, val);
+            }
+
             break;
         case 'g':
             cin >> key_a;
-            tree.get(key_a);
+            tree.get(key_a, output);
+            break;
+        case 'P':
+            // Put the rest of the line as the key's value in the value log
+            cin >> key_a;
+            cin.ignore();
+            getline(cin, value);
+            tree.put_blob(key_a, value);
+            break;
+        case 'G':
+            cin >> key_a;
+            output.blob(tree.get_blob(key_a, value), value);
             break;
         case 'r':
             cin >> key_a >> key_b;
-            tree.range(key_a, key_b);
+            tree.range(key_a, key_b, output);
+            break;
+        case 'f':
+        case 'b':
+            // The first (f) or last (b) limit entries of a range
+            cin >> key_a >> key_b >> limit;
+            tree.range(key_a, key_b, limit, command == 'b', output);
+            break;
+        case 'a':
+            // The count, sum, minimum and maximum of a range's values
+            cin >> key_a >> key_b;
+            agg.clear();
+            tree.aggregate(key_a, key_b, agg);
+            output.aggregate(agg);
             break;
         case 'd':
             cin >> key_a;
             tree.del(key_a);
             break;
+        case 'D':
+            // Every key in [key_a, key_b)
+            cin >> key_a >> key_b;
+            tree.delete_range(key_a, key_b);
+            break;
         case 'l':
             cin.ignore();
             getline(cin, file_path);
             // Trim quotes
-            tree.load(file_path.substr(1, file_path.size() - 2));
-            break;
-		case 's':
-            tree.printStats();
+            file_path = file_path.substr(1, file_path.size() - 2);
+            if (!tree.load(file_path)) {
+                die("Could not locate file '" + file_path + "'.");
+            }
             break;
-        case 'm':
+        case 'c':
             cin.ignore();
             getline(cin, file_path);
             // Trim quotes
-            tree.put_metrics(file_path.substr(1, file_path.size() - 2));
+            if (!tree.checkpoint(file_path.substr(1, file_path.size() - 2), error)) {
+                die(error);
+            }
             break;
-        case 'n':
-            cin >> key_a >> key_b;
-            tree.range_metrics(key_a, key_b);
+		case 's':
+            stream.str("");
+            tree.printStats(stream);
+            output.text(stream.str());
+            break;
+        case 'i':
+        case 'j':
+            stream.str("");
+            tree.print_metrics(command == 'j', stream);
+            output.text(stream.str());
+            break;
+        case 'h':
+            stream.str("");
+            print_latencies(stream);
+            output.text(stream.str());
             break;
         default:
             die("Invalid command.");
@@ -62,20 +160,59 @@ void command_loop(LSMTree& tree) {
 }
 
 int main(int argc, char *argv[]) {
-    int opt, buffer_num_pages, buffer_max_entries, depth, fanout, num_threads;
-    float bf_bits_per_entry;
+    int opt, buffer_num_pages, buffer_max_entries, depth, fanout, num_threads, num_shards;
+    float bf_bits_per_entry, rf_bits_per_entry;
+    filter_type filter;
+    buffer_mode buffer;
+    output_format format;
+    merge_operator merge_op;
+    partitioning scheme;
+    int stall_soft_runs, stall_hard_runs, stall_fields;
+    long stall_soft_mb, stall_hard_mb;
+    double tombstone_density;
+    long tombstone_age;
+    long row_cache_entries;
+    string socket_path, checkpoint_path, value_log_path;
+    double value_log_gc_ratio;
+    long value_log_gc_min_mb;
+    int server_threads;
+    bool report_latencies;
+
+    // Commands are read through cin's own buffer, which lets the command
+    // loop tell whether more of them are already waiting
+    ios::sync_with_stdio(false);
 
     buffer_num_pages = 2;
     depth = DEFAULT_TREE_DEPTH;
     fanout = DEFAULT_TREE_FANOUT;
     num_threads = DEFAULT_THREAD_COUNT;
+    num_shards = DEFAULT_SHARD_COUNT;
+    scheme = PARTITION_HASH;
     bf_bits_per_entry = DEFAULT_BF_BITS_PER_ENTRY;
+    rf_bits_per_entry = DEFAULT_RF_BITS_PER_ENTRY;
+    filter = FILTER_BLOOM;
+    buffer = BUFFER_SORTED;
+    format = OUTPUT_TEXT;
+    merge_op = merge_add;
+    stall_soft_runs = stall_hard_runs = 0;
+    stall_soft_mb = DEFAULT_STALL_SOFT_PENDING_BYTES >> 20;
+    stall_hard_mb = DEFAULT_STALL_HARD_PENDING_BYTES >> 20;
+    tombstone_density = DEFAULT_TOMBSTONE_COMPACTION_DENSITY;
+    tombstone_age = DEFAULT_TOMBSTONE_COMPACTION_AGE;
+    row_cache_entries = DEFAULT_ROW_CACHE_ENTRIES;
+    value_log_gc_ratio = DEFAULT_VALUE_LOG_GC_RATIO;
+    value_log_gc_min_mb = DEFAULT_VALUE_LOG_GC_MIN_BYTES >> 20;
+    server_threads = 0;
+    report_latencies = false;
 
-    while ((opt = getopt(argc, argv, "b:d:f:t:r:")) != -1) {
+    while ((opt = getopt(argc, argv, "b:B:d:f:t:r:R:F:C:N:P:i:lc:w:T:M:V:G:o:S:L:O:")) != -1) {
         switch (opt) {
         case 'b':
             buffer_num_pages = atoi(optarg);
             break;
+        case 'B':
+            buffer = parse_buffer_mode(optarg);
+            break;
         case 'd':
             depth = atoi(optarg);
             break;
@@ -88,20 +225,136 @@ int main(int argc, char *argv[]) {
         case 'r':
             bf_bits_per_entry = atof(optarg);
             break;
+        case 'R':
+            rf_bits_per_entry = atof(optarg);
+            break;
+        case 'F':
+            filter = parse_filter_type(optarg);
+            break;
+        case 'C':
+            row_cache_entries = atol(optarg);
+            break;
+        case 'N':
+            num_shards = atoi(optarg);
+            break;
+        case 'P':
+            scheme = parse_partitioning(optarg);
+            break;
+        case 'i':
+            set_io_backend(optarg);
+            break;
+        case 'l':
+            report_latencies = true;
+            break;
+        case 'c':
+            compaction_rate_limiter.set_rate(atol(optarg) << 20);
+            break;
+        case 'w':
+            stall_fields = sscanf(optarg, "%d,%d,%ld,%ld", &stall_soft_runs, &stall_hard_runs,
+                                  &stall_soft_mb, &stall_hard_mb);
+            if (stall_fields != 2 && stall_fields != 4) {
+                die("Write stall thresholds must be given as soft,hard or soft,hard,soft MB,hard MB.");
+            }
+            break;
+        case 'T':
+            if (sscanf(optarg, "%lf,%ld", &tombstone_density, &tombstone_age) != 2) {
+                die("Tombstone compaction triggers must be given as density,age.");
+            }
+            break;
+        case 'M':
+            merge_op = parse_merge_operator(optarg);
+            break;
+        case 'V':
+            value_log_path = optarg;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%lf,%ld", &value_log_gc_ratio, &value_log_gc_min_mb) != 2) {
+                die("Value log collection triggers must be given as ratio,size.");
+            }
+            break;
+        case 'o':
+            format = parse_output_format(optarg);
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'L':
+            server_threads = atoi(optarg);
+            break;
+        case 'O':
+            checkpoint_path = optarg;
+            break;
         default:
             die("Usage: " + string(argv[0]) + " "
                 "[-b number of pages in buffer] "
-                "[-d number of levels] "
+                "[-B buffer: sorted or append] "
+                "[-d initial number of levels] "
                 "[-f level fanout] "
                 "[-t number of threads] "
                 "[-r bloom filter bits per entry] "
+                "[-R range filter bits per entry, 0 to disable] "
+                "[-F point filter: bloom or xor] "
+                "[-C row cache entries, 0 to disable] "
+                "[-N number of shards] "
+                "[-P shard partitioning: hash or range] "
+                "[-i I/O backend: auto, uring or pread] "
+                "[-l print latency percentiles to stderr at exit] "
+                "[-c flush and compaction I/O limit in MB/s] "
+                "[-w level 1 runs at which puts slow down,stop[,pending compaction MB at which they slow down,stop]] "
+                "[-T tombstone density,age in seconds at which levels are merged down, 0 to disable] "
+                "[-M merge operator: add, max or min] "
+                "[-V keep values put with P in a value log at this path, refusing p and m] "
+                "[-G garbage ratio,size in MB at which the value log is collected, 0 to disable] "
+                "[-o result format: text or binary] "
+                "[-S serve on this Unix socket instead of stdin] "
+                "[-L server event loop threads, default one per shard] "
+                "[-O open the tree from this checkpoint directory] "
                 "<[workload]");
         }
     }
 
+    if (!socket_path.empty()) {
+        block_shutdown_signals();
+    }
+
     buffer_max_entries = buffer_num_pages * getpagesize() / sizeof(entry_t);
-    LSMTree tree(buffer_max_entries, depth, fanout, num_threads, bf_bits_per_entry);
-    command_loop(tree);
+    ShardedLSMTree tree(num_shards, scheme, buffer_max_entries, depth, fanout,
+                        num_threads, bf_bits_per_entry, rf_bits_per_entry, filter);
+    tree.set_row_cache(row_cache_entries);
+    tree.set_buffer_mode(buffer);
+    tree.set_tombstone_compaction(tombstone_density, tombstone_age);
+    tree.set_merge_operator(merge_op);
+
+    if (!value_log_path.empty()) {
+        tree.set_value_log(value_log_path, value_log_gc_ratio, value_log_gc_min_mb << 20);
+    }
+
+    if (!checkpoint_path.empty()) {
+        tree.open_checkpoint(checkpoint_path);
+    }
+
+    if (stall_soft_runs > 0) {
+        tree.set_write_stall(stall_soft_runs, stall_hard_runs,
+                             stall_soft_mb << 20, stall_hard_mb << 20);
+    }
+
+    if (socket_path.empty()) {
+        ResultWriter output(STDOUT_FILENO, format, num_threads);
+
+        results = &output;
+        atexit(flush_results);
+
+        command_loop(tree, output);
+
+        output.flush();
+        results = nullptr;
+    } else {
+        serve(tree, socket_path, server_threads > 0 ? server_threads : tree.shard_count());
+    }
+
+    if (report_latencies) {
+        print_latencies(cerr);
+    }
 
     return 0;
 }
@@ -4,41 +4,140 @@
 #include "merge.h"
 
 // The add function adds a batch of entries (a run) to the MergeContext.
-void MergeContext::add(entry_t *entries, long num_entries) {
+void MergeContext::add(const entry_t *entries, long num_entries, const RangeTombstones *deleted,
+                       const vector<KEY_t> *operands) {
     merge_entry_t merge_entry;
 
     if (num_entries > 0) { // Check if there are any entries to add
         merge_entry.entries = entries; // Set the entries pointer to the given entries
         merge_entry.num_entries = num_entries; // Set the number of entries
+        merge_entry.deleted = deleted != nullptr && !deleted->empty() ? deleted : nullptr;
+        merge_entry.operands = operands != nullptr && !operands->empty() ? operands : nullptr;
+        merge_entry.precedence = queue.size(); // Set the precedence based on the current queue size
+        queue.push(merge_entry); // Add the merge_entry to the priority queue
+    }
+}
+
+// The add function adds a run streamed by a RunReader to the MergeContext.
+void MergeContext::add(RunReader *reader, const RangeTombstones *deleted,
+                       const vector<KEY_t> *operands) {
+    merge_entry_t merge_entry;
+
+    if (reader->chunk_size() > 0) { // Check if the run has any entries
+        merge_entry.entries = reader->chunk(); // Start from the reader's first chunk
+        merge_entry.num_entries = reader->chunk_size();
+        merge_entry.reader = reader;
+        merge_entry.deleted = deleted != nullptr && !deleted->empty() ? deleted : nullptr;
+        merge_entry.operands = operands != nullptr && !operands->empty() ? operands : nullptr;
         merge_entry.precedence = queue.size(); // Set the precedence based on the current queue size
         queue.push(merge_entry); // Add the merge_entry to the priority queue
     }
 }
 
 // The next function returns the next entry to be merged based on the merge_entry_t structures in the priority queue.
+entry_t MergeContext::next(bool& operand) {
+    merge_entry_t next;
+    entry_t entry, older;
+
+    skip_deleted();
+
+    // Copy the entry out before advancing, since a streamed run may reuse
+    // the memory it points into
+    entry = queue.top().head(); // Get the head of the top element from the priority queue
+    operand = queue.top().head_is_operand();
+
+    // Only the most recent value for a given key is returned
+    pop_head();
+
+    if (!operand) {
+        pop_key(entry.key);
+        return entry;
+    }
+
+    // Fold the older entries of the key into the operand, newest first,
+    // until a value, tombstone or range tombstone ends the key's history
+    while (!queue.empty() && queue.top().head().key == entry.key) {
+        next = queue.top();
+        queue.pop();
+
+        if (operand) {
+            older = next.head();
+
+            if (next.deleted != nullptr && next.deleted->covers(entry.key)) {
+                operand = false;
+
+                if (discard) {
+                    discard(older);
+                }
+            } else if (older.val == VAL_TOMBSTONE) {
+                operand = false;
+            } else {
+                operand = next.head_is_operand();
+                entry.val = (*op)(older.val, entry.val);
+            }
+        } else if (discard) {
+            discard(next.head());
+        }
+
+        next.advance();
+        if (!next.done()) {
+            queue.push(next);
+        }
+    }
+
+    return entry;
+}
+
 entry_t MergeContext::next(void) {
-    merge_entry_t current, next;
-    entry_t entry;
+    bool operand;
 
-    current = queue.top(); // Get the top element from the priority queue
-    next = current;
+    return next(operand);
+}
+
+// Moves the top run past its head entry
+void MergeContext::pop_head(void) {
+    merge_entry_t next;
 
-    // While loop ensures that only the most recent value for a given key is returned
-    while (next.head().key == current.head().key && !queue.empty()) {
+    next = queue.top();
+    queue.pop();
+
+    next.advance();
+    if (!next.done()) {
+        queue.push(next);
+    }
+}
+
+// Moves every run past the entries for the key, discarding them
+void MergeContext::pop_key(KEY_t key) {
+    merge_entry_t next;
+
+    while (!queue.empty() && queue.top().head().key == key) {
+        next = queue.top(); // Take the top merge_entry_t holding the same key
         queue.pop(); // Remove the top element from the priority queue
 
-        next.current_index++; // Increment the current_index of the next merge_entry_t
+        if (discard) {
+            discard(next.head());
+        }
+
+        next.advance(); // Move the next merge_entry_t on to its following entry
         if (!next.done()) { // Check if there are more entries in the next merge_entry_t
             queue.push(next); // Push the updated merge_entry_t back into the priority queue
         }
-
-        next = queue.top(); // Update the next merge_entry_t with the new top element from the priority queue
     }
+}
 
-    return current.head(); // Return the most recent value for the given key
+// Drops the keys at the front of the merge whose latest entry is deleted by
+// a newer run's range tombstones. Older entries for the key are deleted too,
+// since older runs are given the range tombstones of every newer run.
+void MergeContext::skip_deleted(void) {
+    while (!queue.empty() && queue.top().deleted != nullptr
+           && queue.top().deleted->covers(queue.top().head().key)) {
+        pop_key(queue.top().head().key);
+    }
 }
 
 // The done function checks if all entries have been merged and returns true if the priority queue is empty.
 bool MergeContext::done(void) {
+    skip_deleted();
     return queue.empty();
 }
@@ -1,6 +1,13 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <algorithm>
 #include <cassert>
 #include <queue>
 
+#include "merge_operator.h"
+#include "range_tombstones.h"
+#include "run.h"
 #include "types.h"
 
 using namespace std;
@@ -8,16 +15,35 @@ using namespace std;
 // Define the merge_entry structure which holds information about a run of entries
 struct merge_entry {
     int precedence; // Precedence value to break ties when keys are equal
-    entry_t *entries; // Pointer to the array of entries in the run
+    const entry_t *entries; // Pointer to the array of entries in the run
     long num_entries; // The number of entries in the run
-    int current_index = 0; // The current index of the entry being processed in the run
+    long current_index = 0; // The current index of the entry being processed in the run
+    RunReader *reader = nullptr; // Streams further chunks of the run, if set
+    const RangeTombstones *deleted = nullptr; // Range tombstones of newer runs, if any
+    const vector<KEY_t> *operands = nullptr; // Sorted keys whose entries are merge operands, if any
 
     // Return the entry at the current_index
     entry_t head(void) const {return entries[current_index];}
 
+    // Return true if the entry at the current_index is a merge operand
+    bool head_is_operand(void) const {
+        return operands != nullptr
+            && binary_search(operands->begin(), operands->end(), entries[current_index].key);
+    }
+
     // Return true if the current_index is equal to the number of entries in the run, indicating that the run has been processed
     bool done(void) const {return current_index == num_entries;}
 
+    // Move on to the next entry, pulling in the reader's next chunk once
+    // the current one is exhausted
+    void advance(void) {
+        if (++current_index == num_entries && reader != nullptr && reader->next()) {
+            entries = reader->chunk();
+            num_entries = reader->chunk_size();
+            current_index = 0;
+        }
+    }
+
     // Overload the '>' operator to compare merge_entry objects
     bool operator>(const merge_entry& other) const {
         // Order first by keys, then by precedence
@@ -33,17 +59,44 @@ struct merge_entry {
 // Typedef for easier readability
 typedef struct merge_entry merge_entry_t;
 
-// Define the MergeContext class which handles merging of runs
+// Define the MergeContext class which handles merging of runs. Each run may
+// be given the range tombstones of the runs newer than it, and keys whose
+// latest entry they delete are left out of the merge. Runs may also be
+// given the keys of their merge operands, which are combined with the
+// older entries of their key using the context's merge operator.
 class MergeContext {
     // Declare a priority queue to store merge_entry_t objects, sorted by keys and precedence
     priority_queue<merge_entry_t, vector<merge_entry_t>, greater<merge_entry_t>> queue;
+    const merge_operator *op = nullptr;
+    function<void(const entry_t&)> discard;
+    void pop_head(void);
+    void pop_key(KEY_t);
+    void skip_deleted(void);
 public:
+    // Sets the operator that combines merge operands
+    void set_merge_operator(const merge_operator *op) {this->op = op;}
+
+    // Sets a function called with every entry the merge leaves out because
+    // a newer entry or range tombstone overwrites it
+    void set_discard_handler(function<void(const entry_t&)> discard) {this->discard = discard;}
+
     // Add a run of entries to the MergeContext
-    void add(entry_t *, long);
+    void add(const entry_t *, long, const RangeTombstones * = nullptr,
+             const vector<KEY_t> * = nullptr);
+
+    // Add a run streamed from disk by a RunReader to the MergeContext
+    void add(RunReader *, const RangeTombstones * = nullptr, const vector<KEY_t> * = nullptr);
 
-    // Get the next entry to be merged
+    // Get the next entry to be merged. Its value is combined from the
+    // operands of every run, and operand is set if no older value was
+    // found to combine them with.
+    entry_t next(bool& operand);
+
+    // Get the next entry to be merged, taking a lone operand as the value
     entry_t next(void);
 
     // Check if all runs have been processed
     bool done(void);
 };
+
+#endif
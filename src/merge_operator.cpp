@@ -0,0 +1,31 @@
+#include <algorithm>
+
+#include "merge_operator.h"
+#include "sys.h"
+
+VAL_t merge_add(VAL_t value, VAL_t operand) {
+    long sum = (long)value + operand;
+
+    return (VAL_t)max((long)VAL_MIN, min((long)VAL_MAX, sum));
+}
+
+VAL_t merge_max(VAL_t value, VAL_t operand) {
+    return max(value, operand);
+}
+
+VAL_t merge_min(VAL_t value, VAL_t operand) {
+    return min(value, operand);
+}
+
+merge_operator parse_merge_operator(string name) {
+    if (name == "add") {
+        return merge_add;
+    } else if (name == "max") {
+        return merge_max;
+    } else if (name == "min") {
+        return merge_min;
+    }
+
+    die("Unknown merge operator '" + name + "': use add, max or min.");
+    return merge_add;
+}
@@ -0,0 +1,36 @@
+#ifndef MERGE_OPERATOR_H
+#define MERGE_OPERATOR_H
+
+#include <functional>
+#include <string>
+
+#include "types.h"
+
+using namespace std;
+
+/*
+ * A merge operator combines an older value of a key with a newer operand
+ * written by LSMTree::merge, as op(older, newer). Operands are written
+ * blind, without reading the key, and are only combined with each other
+ * and with the key's value as merges and reads come across them, so the
+ * operator must be associative. An operand with nothing older to combine
+ * with, or written over a tombstone, stands as the key's value.
+ *
+ * The operator must return values in [VAL_MIN, VAL_MAX], never
+ * VAL_TOMBSTONE, and must not change while the tree holds operands.
+ */
+typedef function<VAL_t(VAL_t, VAL_t)> merge_operator;
+
+// Adds the operand to the value, saturating at VAL_MIN and VAL_MAX. Sums
+// that saturate part way through depend on the order operands are combined
+// in, so counters should stay within range.
+VAL_t merge_add(VAL_t, VAL_t);
+
+// Keeps the larger or the smaller of the value and the operand
+VAL_t merge_max(VAL_t, VAL_t);
+VAL_t merge_min(VAL_t, VAL_t);
+
+// Returns the built-in operator with the given name, "add", "max" or "min"
+merge_operator parse_merge_operator(string);
+
+#endif
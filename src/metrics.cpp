@@ -0,0 +1,103 @@
+#include <mutex>
+#include <vector>
+
+#include "metrics.h"
+
+using namespace std;
+
+const char *metric_names[NUM_METRICS] = {
+    "puts",
+    "gets",
+    "ranges",
+    "deletes",
+    "range_deletes",
+    "merges",
+    "write_batches",
+    "pages_read",
+    "bytes_flushed",
+    "bytes_compacted",
+    "bytes_moved",
+    "tombstones_dropped",
+    "tombstone_compactions",
+    "rate_limited_micros",
+    "write_stalls",
+    "write_stall_micros",
+    "row_cache_hits",
+    "row_cache_misses",
+    "value_log_bytes_written",
+    "value_log_collections",
+    "value_log_bytes_reclaimed",
+};
+
+const char *level_metric_names[NUM_LEVEL_METRICS] = {
+    "filter_probes",
+    "filter_false_positives",
+    "range_filter_probes",
+    "range_filter_skips",
+};
+
+/*
+ * Registry of per-thread counters
+ */
+
+static mutex registry_mutex;
+static vector<thread_metrics *> registry;
+static metrics_snapshot retired; // Counters of threads that have exited
+
+static void add_to_snapshot(metrics_snapshot& snapshot, const thread_metrics& metrics) {
+    int i, j;
+
+    for (i = 0; i < NUM_METRICS; i++) {
+        snapshot.counters[i] += metrics.counters[i].load(memory_order_relaxed);
+    }
+
+    for (i = 0; i < METRICS_MAX_LEVELS; i++) {
+        for (j = 0; j < NUM_LEVEL_METRICS; j++) {
+            snapshot.level_counters[i][j] += metrics.level_counters[i][j].load(memory_order_relaxed);
+        }
+    }
+}
+
+// Registers a thread's counters for its lifetime, folding them into the
+// retired totals when the thread exits
+struct metrics_registration {
+    thread_metrics metrics;
+
+    metrics_registration(void) {
+        for (auto& counter : metrics.counters) counter = 0;
+        for (auto& level : metrics.level_counters) {
+            for (auto& counter : level) counter = 0;
+        }
+
+        lock_guard<mutex> guard(registry_mutex);
+        registry.push_back(&metrics);
+    }
+
+    ~metrics_registration(void) {
+        lock_guard<mutex> guard(registry_mutex);
+
+        add_to_snapshot(retired, metrics);
+
+        for (auto it = registry.begin(); it != registry.end(); it++) {
+            if (*it == &metrics) {
+                registry.erase(it);
+                break;
+            }
+        }
+    }
+};
+
+thread_metrics& local_metrics(void) {
+    static thread_local metrics_registration registration;
+    return registration.metrics;
+}
+
+void collect_metrics(metrics_snapshot& snapshot) {
+    lock_guard<mutex> guard(registry_mutex);
+
+    snapshot = retired;
+
+    for (const auto metrics : registry) {
+        add_to_snapshot(snapshot, *metrics);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+
+// Levels beyond this share the counters of the last one
+#define METRICS_MAX_LEVELS 32
+
+// Tree-wide counters
+enum metric {
+    METRIC_PUTS, // Calls to put, including those made on behalf of deletes and merges
+    METRIC_GETS, // Point lookups
+    METRIC_RANGES, // Range queries
+    METRIC_DELETES, // Calls to del
+    METRIC_RANGE_DELETES, // Calls to delete_range
+    METRIC_MERGES, // Calls to merge
+    METRIC_WRITE_BATCHES, // Write batches applied, whose writes also count as puts and deletes
+    METRIC_PAGES_READ, // Pages read from run files
+    METRIC_BYTES_FLUSHED, // Bytes written by buffer flushes into level 1
+    METRIC_BYTES_COMPACTED, // Bytes written by merges into deeper levels
+    METRIC_BYTES_MOVED, // Bytes of runs moved into deeper levels without being rewritten
+    METRIC_TOMBSTONES_DROPPED, // Tombstones discarded by merges into the last level
+    METRIC_TOMBSTONE_COMPACTIONS, // Merges started by the density or age of a level's tombstones
+    METRIC_RATE_LIMITED_MICROS, // Time flushes and compactions slept in the rate limiter
+    METRIC_WRITE_STALLS, // Puts that were delayed or stopped by the write controller
+    METRIC_WRITE_STALL_MICROS, // Time puts spent delayed or stopped
+    METRIC_ROW_CACHE_HITS, // Point lookups answered by the row cache
+    METRIC_ROW_CACHE_MISSES, // Point lookups that missed the row cache and read the runs
+    METRIC_VALUE_LOG_BYTES_WRITTEN, // Bytes of values and their headers appended to the value log
+    METRIC_VALUE_LOG_COLLECTIONS, // Value log collections
+    METRIC_VALUE_LOG_BYTES_RECLAIMED, // Bytes of garbage dropped by value log collections
+    NUM_METRICS
+};
+
+// Per-level counters
+enum level_metric {
+    LEVEL_FILTER_PROBES, // Bloom filters consulted by point lookups
+    LEVEL_FILTER_FALSE_POSITIVES, // Pages read because of a filter match that held no key
+    LEVEL_RANGE_FILTER_PROBES, // Range filters consulted by range queries
+    LEVEL_RANGE_FILTER_SKIPS, // Runs a range query skipped on a range filter miss
+    NUM_LEVEL_METRICS
+};
+
+// Names used when printing each counter
+extern const char *metric_names[NUM_METRICS];
+extern const char *level_metric_names[NUM_LEVEL_METRICS];
+
+// The counters of a single thread. Each thread only ever writes to its own
+// counters, so updates need no atomic read-modify-write; the fields are
+// atomic only so that they may be read while being written.
+struct thread_metrics {
+    std::atomic<long> counters[NUM_METRICS];
+    std::atomic<long> level_counters[METRICS_MAX_LEVELS][NUM_LEVEL_METRICS];
+
+    void add(metric m, long n) {
+        counters[m].store(counters[m].load(std::memory_order_relaxed) + n,
+                          std::memory_order_relaxed);
+    }
+
+    void add(int level, level_metric m, long n) {
+        std::atomic<long>& counter = level_counters[level < METRICS_MAX_LEVELS ? level : METRICS_MAX_LEVELS - 1][m];
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+};
+
+// A point-in-time sum of every thread's counters
+struct metrics_snapshot {
+    long counters[NUM_METRICS];
+    long level_counters[METRICS_MAX_LEVELS][NUM_LEVEL_METRICS];
+};
+
+// Returns the calling thread's counters, registering them on first use
+thread_metrics& local_metrics(void);
+
+// Increments a counter of the calling thread
+inline void metric_add(metric m, long n = 1) {
+    local_metrics().add(m, n);
+}
+
+inline void metric_add(int level, level_metric m, long n = 1) {
+    local_metrics().add(level, m, n);
+}
+
+// Sums the counters of all threads, including threads that have exited
+void collect_metrics(metrics_snapshot&);
+
+#endif
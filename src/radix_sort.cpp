@@ -0,0 +1,118 @@
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "radix_sort.h"
+#include "worker_pool.h"
+
+#define RADIX_SORT_BUCKETS (1 << RADIX_SORT_BITS)
+
+// Returns the digit of the key sorted on by the pass at the given shift.
+// Flipping the sign bit orders negative keys before positive ones.
+static inline uint32_t digit(KEY_t key, int shift) {
+    return (((uint32_t)key ^ 0x80000000u) >> shift) & (RADIX_SORT_BUCKETS - 1);
+}
+
+void radix_sort(vector<entry_t>& entries, vector<entry_t>& scratch, WorkerPool *pool) {
+    vector<long> histograms;
+    long n, num_slices, slice_size, total;
+    entry_t *from, *to;
+    atomic<long> counter;
+    bool parallel, uniform;
+
+    n = entries.size();
+    scratch.resize(n);
+
+    parallel = pool != nullptr && n >= RADIX_SORT_MIN_PARALLEL;
+    num_slices = parallel ? min((long)RADIX_SORT_MAX_SLICES, n / (RADIX_SORT_MIN_PARALLEL / 4)) : 1;
+    slice_size = (n + num_slices - 1) / num_slices;
+    histograms.resize(num_slices * RADIX_SORT_BUCKETS);
+
+    from = entries.data();
+    to = scratch.data();
+
+    for (int shift = 0; shift < 32; shift += RADIX_SORT_BITS) {
+        // Count the digits of each slice
+        memset(histograms.data(), 0, histograms.size() * sizeof(long));
+        counter = 0;
+
+        worker_task count = [&] {
+            long slice, i, end;
+
+            while ((slice = counter++) < num_slices) {
+                long *histogram = &histograms[slice * RADIX_SORT_BUCKETS];
+
+                end = min(n, (slice + 1) * slice_size);
+                for (i = slice * slice_size; i < end; i++) {
+                    histogram[digit(from[i].key, shift)]++;
+                }
+            }
+        };
+
+        if (parallel) {
+            pool->launch(count);
+            pool->wait_all();
+        } else {
+            count();
+        }
+
+        // Skip the pass if every key has the same digit
+        uniform = false;
+
+        for (int bucket = 0; bucket < RADIX_SORT_BUCKETS && !uniform; bucket++) {
+            total = 0;
+            for (long slice = 0; slice < num_slices; slice++) {
+                total += histograms[slice * RADIX_SORT_BUCKETS + bucket];
+            }
+            uniform = total == n;
+        }
+
+        if (uniform) {
+            continue;
+        }
+
+        // Turn the counts into the offset each slice writes each digit at,
+        // bucket by bucket, and slice by slice within each bucket
+        total = 0;
+
+        for (int bucket = 0; bucket < RADIX_SORT_BUCKETS; bucket++) {
+            for (long slice = 0; slice < num_slices; slice++) {
+                long& offset = histograms[slice * RADIX_SORT_BUCKETS + bucket];
+                long count = offset;
+
+                offset = total;
+                total += count;
+            }
+        }
+
+        // Scatter each slice's entries to their offsets, keeping their order
+        counter = 0;
+
+        worker_task scatter = [&] {
+            long slice, i, end;
+
+            while ((slice = counter++) < num_slices) {
+                long *offsets = &histograms[slice * RADIX_SORT_BUCKETS];
+
+                end = min(n, (slice + 1) * slice_size);
+                for (i = slice * slice_size; i < end; i++) {
+                    to[offsets[digit(from[i].key, shift)]++] = from[i];
+                }
+            }
+        };
+
+        if (parallel) {
+            pool->launch(scatter);
+            pool->wait_all();
+        } else {
+            scatter();
+        }
+
+        swap(from, to);
+    }
+
+    // An odd number of passes leaves the sorted entries in scratch
+    if (from != entries.data()) {
+        entries.swap(scratch);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <vector>
+
+#include "types.h"
+
+using namespace std;
+
+class WorkerPool;
+
+// Bits of the key sorted on by each pass
+#define RADIX_SORT_BITS 8
+
+// Arrays shorter than this are sorted on the calling thread alone
+#define RADIX_SORT_MIN_PARALLEL 65536
+
+// Maximum number of slices the array is split into for a parallel pass
+#define RADIX_SORT_MAX_SLICES 64
+
+/*
+ * Sorts entries by key with a least significant digit radix sort over
+ * the signed 32-bit keys, using scratch as the second buffer. Each pass
+ * splits the array into slices. The slices' digit histograms are
+ * counted in parallel on the pool's workers, and each slice then
+ * scatters its entries to its own offsets in parallel. Passes on a
+ * digit that every key shares are skipped.
+ */
+void radix_sort(vector<entry_t>&, vector<entry_t>&, WorkerPool *);
+
+#endif
@@ -0,0 +1,100 @@
+#include "range_filter.h"
+
+// Number of bits set in the table for each block
+#define RANGE_FILTER_HASHES 2
+
+// Maps a key onto an unsigned offset, so that prefixes keep the key order
+static uint32_t key_offset(KEY_t key) {
+    return (uint32_t)key - (uint32_t)KEY_MIN;
+}
+
+static int level_shift(int level) {
+    return (level + 1) * RANGE_FILTER_LEVEL_BITS;
+}
+
+// Mixes a block's prefix and level into a 64-bit hash (the splitmix64
+// finalizer), of which each half drives one of the double-hashing steps
+uint64_t RangeFilter::hash(uint32_t prefix, int level) const {
+    uint64_t h;
+
+    h = ((uint64_t)prefix << 8 | level) + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// Sets the blocks holding the key. Consecutive keys of a run mostly fall in
+// the same blocks, which are only set once.
+void RangeFilter::add(KEY_t key) {
+    uint32_t prefix;
+    uint64_t h;
+    int level, i;
+
+    if (!enabled()) {
+        return;
+    }
+
+    for (level = 0; level < RANGE_FILTER_LEVELS; level++) {
+        prefix = key_offset(key) >> level_shift(level);
+
+        if (!empty && prefix == last_prefixes[level]) {
+            continue;
+        }
+
+        last_prefixes[level] = prefix;
+        h = hash(prefix, level);
+
+        for (i = 0; i < RANGE_FILTER_HASHES; i++) {
+            table.set(((h >> 32) + i * (uint32_t)h) % table.size());
+        }
+    }
+
+    empty = false;
+}
+
+// Checks whether the run may hold a key in the inclusive range [start, end]
+bool RangeFilter::may_overlap(KEY_t start, KEY_t end) const {
+    uint32_t first, last, prefix;
+    uint64_t h;
+    int level, i;
+    bool set;
+
+    if (!enabled()) {
+        return true;
+    }
+
+    if (empty) {
+        return false;
+    }
+
+    // Pick the finest level that covers the range in few enough blocks
+    for (level = 0; level < RANGE_FILTER_LEVELS; level++) {
+        first = key_offset(start) >> level_shift(level);
+        last = key_offset(end) >> level_shift(level);
+
+        if (last - first < RANGE_FILTER_MAX_PROBES) {
+            break;
+        }
+    }
+
+    if (level == RANGE_FILTER_LEVELS) {
+        return true;
+    }
+
+    for (prefix = first; ; prefix++) {
+        h = hash(prefix, level);
+        set = true;
+
+        for (i = 0; i < RANGE_FILTER_HASHES && set; i++) {
+            set = table.test(((h >> 32) + i * (uint32_t)h) % table.size());
+        }
+
+        if (set) {
+            return true;
+        }
+
+        if (prefix == last) {
+            return false;
+        }
+    }
+}
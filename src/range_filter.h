@@ -0,0 +1,39 @@
+#ifndef RANGE_FILTER_H
+#define RANGE_FILTER_H
+
+#include <boost/dynamic_bitset.hpp>
+#include <cstdint>
+
+#include "types.h"
+
+// The filter records key prefixes at several granularities. Level l holds
+// the prefixes left once the low (l + 1) * RANGE_FILTER_LEVEL_BITS bits of
+// a key are dropped, i.e. the aligned blocks of 64 and 4096 keys that hold
+// at least one of the run's keys.
+#define RANGE_FILTER_LEVELS 2
+#define RANGE_FILTER_LEVEL_BITS 6
+
+// Most blocks probed for a single query. Queries spanning more blocks than
+// this at the coarsest level are assumed to overlap the run.
+#define RANGE_FILTER_MAX_PROBES 8
+
+// The RangeFilter class is a prefix bloom filter answering whether a run
+// may hold any key in an interval. A query is covered by the blocks of the
+// finest level it spans in at most RANGE_FILTER_MAX_PROBES blocks, and may
+// overlap the run only if one of those blocks is set. Like a bloom filter it
+// has false positives but no false negatives.
+class RangeFilter {
+    boost::dynamic_bitset<> table;
+    uint32_t last_prefixes[RANGE_FILTER_LEVELS];
+    bool empty;
+    uint64_t hash(uint32_t, int) const;
+public:
+    // Filters are sized in bits per key, and a size of 0 disables them
+    RangeFilter(long length) : table(length), empty(true) {}
+    bool enabled(void) const {return table.size() > 0;}
+    // Keys must be added in ascending order, as runs are written
+    void add(KEY_t);
+    bool may_overlap(KEY_t, KEY_t) const;
+};
+
+#endif
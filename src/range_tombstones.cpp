@@ -0,0 +1,77 @@
+#include <algorithm>
+
+#include "range_tombstones.h"
+
+void RangeTombstones::add(KEY_t start, KEY_t end) {
+    vector<pair<KEY_t, KEY_t>>::iterator first, last;
+
+    if (start > end) {
+        return;
+    }
+
+    // Find the ranges that overlap or adjoin [start, end]
+    first = lower_bound(ranges.begin(), ranges.end(), start,
+                        [](const pair<KEY_t, KEY_t>& range, KEY_t key) {
+                            return (long)range.second + 1 < key;
+                        });
+    last = first;
+
+    while (last != ranges.end() && (long)last->first <= (long)end + 1) {
+        start = min(start, last->first);
+        end = max(end, last->second);
+        last++;
+    }
+
+    // Replace them with their union
+    first = ranges.erase(first, last);
+    ranges.insert(first, make_pair(start, end));
+}
+
+void RangeTombstones::add(const RangeTombstones& other, KEY_t start, KEY_t end) {
+    for (const auto& range : other.ranges) {
+        if (range.second >= start && range.first <= end) {
+            add(max(range.first, start), min(range.second, end));
+        }
+    }
+}
+
+bool RangeTombstones::covers(KEY_t key) const {
+    return covers(key, key);
+}
+
+bool RangeTombstones::covers(KEY_t start, KEY_t end) const {
+    vector<pair<KEY_t, KEY_t>>::const_iterator range;
+
+    // Find the first range ending at or after start
+    range = lower_bound(ranges.begin(), ranges.end(), start,
+                        [](const pair<KEY_t, KEY_t>& range, KEY_t key) {
+                            return range.second < key;
+                        });
+
+    return range != ranges.end() && range->first <= start && end <= range->second;
+}
+
+void RangeTombstones::remove_covered(vector<entry_t>& entries, long first) const {
+    vector<pair<KEY_t, KEY_t>>::const_iterator range;
+    long i, kept;
+
+    if (ranges.empty()) {
+        return;
+    }
+
+    range = ranges.begin();
+    kept = first;
+
+    // Walk the entries and ranges together, both being sorted
+    for (i = first; i < entries.size(); i++) {
+        while (range != ranges.end() && range->second < entries[i].key) {
+            range++;
+        }
+
+        if (range == ranges.end() || entries[i].key < range->first) {
+            entries[kept++] = entries[i];
+        }
+    }
+
+    entries.resize(kept);
+}
@@ -0,0 +1,42 @@
+#ifndef RANGE_TOMBSTONES_H
+#define RANGE_TOMBSTONES_H
+
+#include <utility>
+#include <vector>
+
+#include "types.h"
+
+using namespace std;
+
+/*
+ * The RangeTombstones class holds the key ranges deleted by range deletes,
+ * as sorted, disjoint inclusive intervals. The buffer and each run keep the
+ * range tombstones written into them. These delete the entries of every
+ * older buffer or run, but never the source's own entries, which are
+ * always newer than its range tombstones.
+ */
+class RangeTombstones {
+    vector<pair<KEY_t, KEY_t>> ranges;
+public:
+    bool empty(void) const {return ranges.empty();}
+    long size(void) const {return ranges.size();}
+    const vector<pair<KEY_t, KEY_t>>& intervals(void) const {return ranges;}
+    void clear(void) {ranges.clear();}
+
+    // Adds the range [start, end], merging it with the ranges it touches
+    void add(KEY_t, KEY_t);
+
+    // Adds the parts of another set's ranges within [start, end]
+    void add(const RangeTombstones&, KEY_t = KEY_MIN, KEY_t = KEY_MAX);
+
+    // Returns whether the key is deleted
+    bool covers(KEY_t) const;
+
+    // Returns whether every key in [start, end] is deleted
+    bool covers(KEY_t, KEY_t) const;
+
+    // Removes the deleted entries from a vector of entries sorted by key
+    void remove_covered(vector<entry_t>&, long = 0) const;
+};
+
+#endif
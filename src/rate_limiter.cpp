@@ -0,0 +1,44 @@
+#include <thread>
+
+#include "metrics.h"
+#include "rate_limiter.h"
+
+using namespace std;
+
+RateLimiter compaction_rate_limiter;
+
+void RateLimiter::set_rate(long bytes_per_sec) {
+    lock_guard<mutex> guard(lock);
+
+    rate = bytes_per_sec > 0 ? bytes_per_sec : 0;
+    available = rate * RATE_LIMITER_BURST_SECONDS;
+    last_refill = chrono::steady_clock::now();
+}
+
+// Takes tokens for a transfer of the given number of bytes, sleeping until
+// the bucket would have refilled enough to cover it
+void RateLimiter::request(long bytes) {
+    chrono::steady_clock::time_point now;
+    double wait;
+
+    if (rate == 0) {
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        now = chrono::steady_clock::now();
+        available = min(available + rate * chrono::duration<double>(now - last_refill).count(),
+                        rate * RATE_LIMITER_BURST_SECONDS);
+        last_refill = now;
+
+        available -= bytes;
+        wait = available < 0 ? -available / rate : 0;
+    }
+
+    if (wait > 0) {
+        metric_add(METRIC_RATE_LIMITED_MICROS, (long)(wait * 1e6));
+        this_thread::sleep_for(chrono::duration<double>(wait));
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <chrono>
+#include <mutex>
+
+// Longest period of inactivity the bucket saves up tokens for, bounding the
+// burst allowed after an idle spell
+#define RATE_LIMITER_BURST_SECONDS 0.1
+
+// The RateLimiter class is a token bucket that paces I/O to a number of
+// bytes per second. Callers ask for tokens before each transfer and sleep
+// off any shortfall, so a large request is let through at once and paid
+// for by the requests that follow it.
+class RateLimiter {
+    std::mutex lock;
+    double rate; // Bytes per second, or 0 for no limit
+    double available; // Tokens in the bucket, negative while in debt
+    std::chrono::steady_clock::time_point last_refill;
+public:
+    RateLimiter(void) : rate(0), available(0) {}
+    void set_rate(long);
+    long get_rate(void) const {return rate;}
+    void request(long);
+};
+
+// Paces the I/O of buffer flushes and compactions, leaving page reads for
+// point lookups and range scans unthrottled
+extern RateLimiter compaction_rate_limiter;
+
+#endif
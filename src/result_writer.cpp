@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "result_writer.h"
+#include "sys.h"
+#include "worker_pool.h"
+
+// The text of every number from 00 to 99
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// The longest text of a number, and of a key:value pair with its separator
+#define MAX_NUMBER_CHARS 20
+#define MAX_ENTRY_CHARS 24
+
+output_format parse_output_format(string name) {
+    if (name == "text") {
+        return OUTPUT_TEXT;
+    } else if (name == "binary") {
+        return OUTPUT_BINARY;
+    }
+
+    die("Unknown output format '" + name + "'.");
+    return OUTPUT_TEXT;
+}
+
+// Writes the decimal text of a number at p, returning the end of the text
+static char *format_number(char *p, long value) {
+    char digits[MAX_NUMBER_CHARS];
+    char *q = digits + sizeof(digits);
+    unsigned long n = value < 0 ? -(unsigned long)value : value;
+
+    while (n >= 100) {
+        q -= 2;
+        memcpy(q, digit_pairs + (n % 100) * 2, 2);
+        n /= 100;
+    }
+
+    if (n >= 10) {
+        q -= 2;
+        memcpy(q, digit_pairs + n * 2, 2);
+    } else {
+        *--q = '0' + n;
+    }
+
+    if (value < 0) {
+        *p++ = '-';
+    }
+
+    memcpy(p, q, digits + sizeof(digits) - q);
+    return p + (digits + sizeof(digits) - q);
+}
+
+void append_number(string& output, long value) {
+    char text[MAX_NUMBER_CHARS + 1];
+
+    output.append(text, format_number(text, value) - text);
+}
+
+// Room for every pair is made up front, and the string is cut back to the
+// text actually written, so no pair is appended separately
+void append_entries(string& output, const entry_t *entries, long num_entries) {
+    long first;
+    char *p;
+
+    first = output.size();
+    output.resize(first + num_entries * MAX_ENTRY_CHARS);
+    p = &output[first];
+
+    for (long i = 0; i < num_entries; i++) {
+        if (i > 0) *p++ = ' ';
+        p = format_number(p, entries[i].key);
+        *p++ = ':';
+        p = format_number(p, entries[i].val);
+    }
+
+    output.resize(p - output.data());
+}
+
+ResultWriter::ResultWriter(int fd, output_format format, int num_threads) :
+    fd(fd), format(format)
+{
+    buffer.reserve(RESULT_FLUSH_BYTES * 2);
+
+    if (num_threads > 1) {
+        pool.reset(new WorkerPool(num_threads));
+    }
+}
+
+ResultWriter::~ResultWriter(void) {
+    flush();
+}
+
+void ResultWriter::append_binary(const void *data, long size) {
+    buffer.append((const char *)data, size);
+}
+
+// Ends a query's result, writing out the buffer once it is full enough
+void ResultWriter::end_result(void) {
+    if (format == OUTPUT_TEXT) {
+        buffer += '\n';
+    }
+
+    if (buffer.size() >= RESULT_FLUSH_BYTES) {
+        flush();
+    }
+}
+
+void ResultWriter::value(bool found, VAL_t val) {
+    int64_t count = found ? 1 : 0;
+
+    if (format == OUTPUT_BINARY) {
+        append_binary(&count, sizeof(count));
+        if (found) append_binary(&val, sizeof(val));
+    } else if (found) {
+        append_number(buffer, val);
+    }
+
+    end_result();
+}
+
+void ResultWriter::blob(bool found, const string& value) {
+    int64_t length = found ? value.size() : -1;
+
+    if (format == OUTPUT_BINARY) {
+        append_binary(&length, sizeof(length));
+    }
+
+    if (found) {
+        buffer += value;
+    }
+
+    end_result();
+}
+
+// Wide ranges are cut into chunks, which the workers format into their own
+// strings before they are appended in order
+void ResultWriter::range(const vector<entry_t>& entries) {
+    int64_t count = entries.size();
+    atomic<long> counter;
+    long num_chunks;
+
+    if (format == OUTPUT_BINARY) {
+        append_binary(&count, sizeof(count));
+        append_binary(entries.data(), entries.size() * sizeof(entry_t));
+    } else if (pool == nullptr || entries.size() < PARALLEL_FORMAT_MIN_ENTRIES) {
+        append_entries(buffer, entries.data(), entries.size());
+    } else {
+        num_chunks = (entries.size() + FORMAT_CHUNK_ENTRIES - 1) / FORMAT_CHUNK_ENTRIES;
+        if (chunks.size() < num_chunks) {
+            chunks.resize(num_chunks);
+        }
+
+        counter = 0;
+
+        worker_task format_chunks = [&] {
+            long chunk, first;
+
+            while ((chunk = counter++) < num_chunks) {
+                first = chunk * FORMAT_CHUNK_ENTRIES;
+
+                chunks[chunk].clear();
+                if (chunk > 0) chunks[chunk] += ' ';
+                append_entries(chunks[chunk], entries.data() + first,
+                               min(FORMAT_CHUNK_ENTRIES, (long)entries.size() - first));
+            }
+        };
+
+        pool->launch(format_chunks);
+        pool->wait_all();
+
+        for (long i = 0; i < num_chunks; i++) {
+            buffer += chunks[i];
+        }
+    }
+
+    end_result();
+}
+
+void ResultWriter::aggregate(const RangeAggregate& agg) {
+    int64_t values[5] = {4, agg.count, agg.sum, agg.count > 0 ? agg.min : 0, agg.count > 0 ? agg.max : 0};
+
+    if (format == OUTPUT_BINARY) {
+        append_binary(values, sizeof(values));
+    } else {
+        append_number(buffer, agg.count);
+        buffer += ' ';
+        append_number(buffer, agg.sum);
+
+        if (agg.count > 0) {
+            buffer += ' ';
+            append_number(buffer, agg.min);
+            buffer += ' ';
+            append_number(buffer, agg.max);
+        }
+    }
+
+    end_result();
+}
+
+void ResultWriter::text(const string& text) {
+    buffer += text;
+
+    if (buffer.size() >= RESULT_FLUSH_BYTES) {
+        flush();
+    }
+}
+
+// Writes the buffer with as few writes as the file descriptor allows,
+// which is a single one unless it is interrupted or a pipe fills up
+bool ResultWriter::write_pending(void) {
+    const char *p = buffer.data();
+    long remaining = buffer.size();
+    ssize_t written;
+
+    while (remaining > 0) {
+        written = write(fd, p, remaining);
+
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1) {
+            buffer.clear();
+            return false;
+        }
+
+        p += written;
+        remaining -= written;
+    }
+
+    buffer.clear();
+    return true;
+}
+
+// The failed results are dropped before dying, so that exit handlers
+// flushing this writer have nothing left to write
+void ResultWriter::flush(void) {
+    if (!write_pending()) {
+        die("Could not write results: " + string(strerror(errno)));
+    }
+}
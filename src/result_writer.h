@@ -0,0 +1,85 @@
+#ifndef RESULT_WRITER_H
+#define RESULT_WRITER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "aggregate.h"
+#include "types.h"
+
+using namespace std;
+
+class WorkerPool;
+
+// Query results are written out once this many bytes are pending
+#define RESULT_FLUSH_BYTES (1L << 20)
+
+// Range results of at least this many entries are formatted as text on the
+// worker pool, each worker taking chunks of this many entries at a time
+#define PARALLEL_FORMAT_MIN_ENTRIES (1L << 16)
+#define FORMAT_CHUNK_ENTRIES (1L << 14)
+
+// How query results are written. Text results are one line per query, as
+// described for each method of ResultWriter. Binary results start with a
+// 64-bit count of the items that follow, in native byte order.
+enum output_format {OUTPUT_TEXT, OUTPUT_BINARY};
+
+// Parses an output format name, "text" or "binary"
+output_format parse_output_format(string);
+
+// Appends the decimal text of a number to a string
+void append_number(string&, long);
+
+// Appends entries as space-separated key:value pairs to a string
+void append_entries(string&, const entry_t *, long);
+
+/*
+ * The ResultWriter class serialises query results into a large reusable
+ * buffer, which is written to a file descriptor with a single write once it
+ * fills up or is flushed, rather than going through an ostream and
+ * flushing after every query. Numbers are converted to text two digits at
+ * a time, and wide range results are converted in parallel.
+ */
+class ResultWriter {
+    int fd;
+    output_format format;
+    string buffer;
+    unique_ptr<WorkerPool> pool;
+    vector<string> chunks;
+    void append_binary(const void *, long);
+    void end_result(void);
+public:
+    ResultWriter(int, output_format, int);
+    ~ResultWriter(void);
+
+    // A lookup's value, or an empty line if the key was not found. Binary
+    // results are a count of 0 or 1 followed by the value.
+    void value(bool, VAL_t);
+
+    // A value read from the value log, or an empty line if the key was not
+    // found. Binary results are the value's length, or -1 if the key was not
+    // found, followed by its bytes.
+    void blob(bool, const string&);
+
+    // A range's entries as key:value pairs. Binary results are the number
+    // of entries followed by the entries in the format of load files.
+    void range(const vector<entry_t>&);
+
+    // A range's "count sum min max", or "0 0" for an empty range. Binary
+    // results are a count of 4 followed by all four, with a minimum and
+    // maximum of 0 for an empty range.
+    void aggregate(const RangeAggregate&);
+
+    // Text that is not a query result, such as statistics, in either format
+    void text(const string&);
+
+    // Writes out the pending results, dying on a write error
+    void flush(void);
+
+    // Writes out the pending results, returning false on a write error
+    // instead of dying. The results are dropped either way.
+    bool write_pending(void);
+};
+
+#endif
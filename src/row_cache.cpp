@@ -0,0 +1,269 @@
+#include "row_cache.h"
+
+using namespace std;
+
+// Hashes a key (the murmur3 64-bit finalizer). The top bits select the
+// shard and the low bits the bucket, so the two are independent.
+static uint64_t row_hash(KEY_t key) {
+    uint64_t h;
+
+    h = (uint32_t)key;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+    h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+// Returns the smallest power of two that is at least n
+static uint64_t power_of_two(long n) {
+    uint64_t power = 1;
+
+    while (power < n) {
+        power <<= 1;
+    }
+
+    return power;
+}
+
+/*
+ * FrequencySketch
+ */
+
+FrequencySketch::FrequencySketch(long capacity) {
+    mask = power_of_two(max(capacity, 64L)) - 1;
+    table.assign(ROW_CACHE_SKETCH_DEPTH * (mask + 1), 0);
+    additions = 0;
+    sample_size = ROW_CACHE_SAMPLE_FACTOR * max(capacity, 1L);
+}
+
+// Returns the counter for the hash in the given row
+long FrequencySketch::position(uint64_t hash, int row) const {
+    return row * (mask + 1) + ((hash + row * (hash >> 32 | 1)) >> 7 & mask);
+}
+
+void FrequencySketch::increment(uint64_t hash) {
+    int row;
+
+    for (row = 0; row < ROW_CACHE_SKETCH_DEPTH; row++) {
+        uint8_t& counter = table[position(hash, row)];
+        if (counter < 15) counter++;
+    }
+
+    // Age the counts once enough accesses have been seen
+    if (++additions >= sample_size) {
+        for (auto& counter : table) {
+            counter >>= 1;
+        }
+
+        additions /= 2;
+    }
+}
+
+int FrequencySketch::estimate(uint64_t hash) const {
+    int row, frequency;
+
+    frequency = 15;
+
+    for (row = 0; row < ROW_CACHE_SKETCH_DEPTH; row++) {
+        frequency = min(frequency, (int)table[position(hash, row)]);
+    }
+
+    return frequency;
+}
+
+/*
+ * Shards
+ */
+
+row_cache_shard::row_cache_shard(long capacity) : sketch(capacity) {
+    slots.resize(capacity);
+
+    // Chain every slot into the free list
+    for (int i = 0; i < capacity; i++) {
+        slots[i].next = i + 1 < capacity ? i + 1 : -1;
+    }
+
+    free_slots = 0;
+    head = tail = -1;
+
+    // Keep the index at most half full
+    index_mask = power_of_two(2 * capacity) - 1;
+    index.assign(index_mask + 1, -1);
+}
+
+// Returns the key's slot, or -1, along with its bucket in the index (or
+// the empty bucket where it would go)
+int row_cache_shard::find(KEY_t key, uint64_t hash, long& bucket) const {
+    for (bucket = hash & index_mask; index[bucket] != -1; bucket = (bucket + 1) & index_mask) {
+        if (slots[index[bucket]].key == key) {
+            return index[bucket];
+        }
+    }
+
+    return -1;
+}
+
+void row_cache_shard::unlink(int slot) {
+    row_cache_slot& s = slots[slot];
+
+    if (s.prev != -1) slots[s.prev].next = s.next; else head = s.next;
+    if (s.next != -1) slots[s.next].prev = s.prev; else tail = s.prev;
+}
+
+void row_cache_shard::push_front(int slot) {
+    slots[slot].prev = -1;
+    slots[slot].next = head;
+
+    if (head != -1) slots[head].prev = slot; else tail = slot;
+    head = slot;
+}
+
+// Empties a bucket of the index, shifting back the entries after it that
+// would no longer be reachable from their home bucket
+void row_cache_shard::remove(long bucket) {
+    long next, home;
+
+    next = bucket;
+
+    while (true) {
+        next = (next + 1) & index_mask;
+
+        if (index[next] == -1) {
+            break;
+        }
+
+        home = row_hash(slots[index[next]].key) & index_mask;
+
+        // Move the entry back unless its home lies cyclically in (bucket, next]
+        if ((next > bucket && (home <= bucket || home > next))
+            || (next < bucket && (home <= bucket && home > next))) {
+            index[bucket] = index[next];
+            bucket = next;
+        }
+    }
+
+    index[bucket] = -1;
+}
+
+/*
+ * RowCache
+ */
+
+void RowCache::set_capacity(long capacity) {
+    shards.clear();
+
+    if (capacity <= 0) {
+        return;
+    }
+
+    for (int i = 0; i < ROW_CACHE_SHARDS; i++) {
+        shards.emplace_back(new row_cache_shard((capacity + ROW_CACHE_SHARDS - 1) / ROW_CACHE_SHARDS));
+    }
+}
+
+// Looks up a key, counting the access towards its admission
+bool RowCache::get(KEY_t key, VAL_t& val) {
+    uint64_t hash;
+    long bucket;
+    int slot;
+
+    hash = row_hash(key);
+    row_cache_shard& s = shard(hash);
+    lock_guard<mutex> guard(s.lock);
+
+    s.sketch.increment(hash);
+
+    if ((slot = s.find(key, hash, bucket)) == -1) {
+        return false;
+    }
+
+    s.unlink(slot);
+    s.push_front(slot);
+    val = s.slots[slot].val;
+
+    return true;
+}
+
+// Caches a lookup's outcome, if the key is accessed more often than the
+// entry it would evict
+void RowCache::insert(KEY_t key, VAL_t val) {
+    uint64_t hash;
+    long bucket, victim_bucket;
+    int slot;
+
+    hash = row_hash(key);
+    row_cache_shard& s = shard(hash);
+    lock_guard<mutex> guard(s.lock);
+
+    if ((slot = s.find(key, hash, bucket)) != -1) {
+        s.slots[slot].val = val;
+        return;
+    }
+
+    if (s.free_slots != -1) {
+        slot = s.free_slots;
+        s.free_slots = s.slots[slot].next;
+    } else {
+        slot = s.tail;
+
+        if (s.sketch.estimate(hash) <= s.sketch.estimate(row_hash(s.slots[slot].key))) {
+            return;
+        }
+
+        s.find(s.slots[slot].key, row_hash(s.slots[slot].key), victim_bucket);
+        s.remove(victim_bucket);
+        s.unlink(slot);
+
+        // The removal may have shifted the key's bucket
+        s.find(key, hash, bucket);
+    }
+
+    s.slots[slot].key = key;
+    s.slots[slot].val = val;
+    s.index[bucket] = slot;
+    s.push_front(slot);
+}
+
+void RowCache::erase(KEY_t key) {
+    uint64_t hash;
+    long bucket;
+    int slot;
+
+    hash = row_hash(key);
+    row_cache_shard& s = shard(hash);
+    lock_guard<mutex> guard(s.lock);
+
+    if ((slot = s.find(key, hash, bucket)) == -1) {
+        return;
+    }
+
+    s.remove(bucket);
+    s.unlink(slot);
+    s.slots[slot].next = s.free_slots;
+    s.free_slots = slot;
+}
+
+// Walks each shard's entries rather than the keys of the range, which may
+// be far more numerous than the cache
+void RowCache::erase_range(KEY_t start, KEY_t end) {
+    long bucket;
+    int slot, next;
+
+    for (auto& shard : shards) {
+        row_cache_shard& s = *shard;
+        lock_guard<mutex> guard(s.lock);
+
+        for (slot = s.head; slot != -1; slot = next) {
+            next = s.slots[slot].next;
+
+            if (s.slots[slot].key < start || s.slots[slot].key > end) {
+                continue;
+            }
+
+            s.find(s.slots[slot].key, row_hash(s.slots[slot].key), bucket);
+            s.remove(bucket);
+            s.unlink(slot);
+            s.slots[slot].next = s.free_slots;
+            s.free_slots = slot;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef ROW_CACHE_H
+#define ROW_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "types.h"
+
+// Number of independently locked shards the cache is split into
+#define ROW_CACHE_SHARDS 16
+
+// Rows of counters in each shard's frequency sketch
+#define ROW_CACHE_SKETCH_DEPTH 4
+
+// The sketch's counters are halved once it has counted this many accesses
+// per cache entry, so that frequencies favour recent traffic
+#define ROW_CACHE_SAMPLE_FACTOR 10
+
+// The FrequencySketch class estimates how often each key has been accessed
+// recently, in a count-min sketch of 4-bit saturating counters (TinyLFU)
+class FrequencySketch {
+    std::vector<uint8_t> table;
+    uint64_t mask;
+    long additions, sample_size;
+    long position(uint64_t, int) const;
+public:
+    FrequencySketch(long);
+    void increment(uint64_t);
+    int estimate(uint64_t) const;
+};
+
+// One slot of a shard, linked into either the LRU list or the free list
+struct row_cache_slot {
+    KEY_t key;
+    VAL_t val;
+    int prev, next;
+};
+
+// A shard holds a fixed number of slots, found through an open addressing
+// index of slot numbers, so that the cache never allocates once built
+struct row_cache_shard {
+    std::mutex lock;
+    std::vector<row_cache_slot> slots;
+    std::vector<int> index; // Slot numbers, or -1 for an empty bucket
+    uint64_t index_mask;
+    int head, tail; // Most and least recently used slots
+    int free_slots; // First unused slot
+    FrequencySketch sketch;
+
+    row_cache_shard(long);
+    int find(KEY_t, uint64_t, long&) const;
+    void unlink(int);
+    void push_front(int);
+    void remove(long);
+};
+
+/*
+ * The RowCache class caches the outcome of point lookups that had to go to
+ * the runs: the key's value, or VAL_TOMBSTONE when the key has no live
+ * value. Entries are evicted in LRU order, but a new key is only admitted
+ * in place of the LRU entry if the sketch estimates it to be accessed more
+ * often, so that a scan over cold keys cannot flush the hot set.
+ *
+ * Writes must erase the key, since the cache is consulted before the runs.
+ */
+class RowCache {
+    std::vector<std::unique_ptr<row_cache_shard>> shards;
+    row_cache_shard& shard(uint64_t hash) const {
+        return *shards[hash >> 60 & (ROW_CACHE_SHARDS - 1)];
+    }
+public:
+    RowCache(void) {}
+    // Empties the cache and sets the number of entries it holds, with 0
+    // disabling it
+    void set_capacity(long);
+    bool enabled(void) const {return !shards.empty();}
+    bool get(KEY_t, VAL_t&);
+    void insert(KEY_t, VAL_t);
+    void erase(KEY_t);
+    // Erases every key in [start, end]
+    void erase_range(KEY_t, KEY_t);
+};
+
+#endif
@@ -1,128 +1,271 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "metrics.h"
+#include "rate_limiter.h"
 #include "sys.h"
 #include "run.h"
 
 using namespace std;
 
-Run::Run(long max_size, float bf_bits_per_entry) :
-         max_size(max_size),
-         bloom_filter(max_size * bf_bits_per_entry)
+// Number of pages a range scan reads with a single request
+#define RANGE_READ_PAGES 16
+
+filter_type parse_filter_type(string name) {
+    if (name == "bloom") {
+        return FILTER_BLOOM;
+    } else if (name == "xor") {
+        return FILTER_XOR;
+    }
+
+    die("Unknown filter type '" + name + "'.");
+    return FILTER_BLOOM;
+}
+
+Run::Run(long max_size, float bf_bits_per_entry, float rf_bits_per_entry,
+         filter_type filter) :
+         filter(filter),
+         bloom_filter(filter == FILTER_BLOOM ? max_size * bf_bits_per_entry : 0),
+         range_filter(max_size * rf_bits_per_entry),
+         max_size(max_size)
 {
-    char *tmp_fn;
+    char tmp_fn[] = TMP_FILE_PATTERN;
 
     size = 0;
-    fence_pointers.reserve(max_size / getpagesize());
+    tombstones = 0;
+    oldest_tombstone = 0;
+    max_key = KEY_MIN;
+    fence_pointers.reserve(max_size / PAGE_ENTRIES + 1);
+
+    // The run keeps its file open for its whole lifetime so that page
+    // reads don't pay for an open() each time
+    fd = mkstemp(tmp_fn);
+    if (fd == -1) {
+        die("Could not create run file: " + string(strerror(errno)));
+    }
+    tmp_file = tmp_fn;
+}
 
-    tmp_fn = strdup(TMP_FILE_PATTERN);
-    tmp_file = mkstemp(tmp_fn);
+// Takes over another run's file, leaving the other run empty so that its
+// destructor leaves the file in place
+Run::Run(Run&& other) :
+         filter(other.filter),
+         bloom_filter(std::move(other.bloom_filter)),
+         xor_filter(std::move(other.xor_filter)),
+         range_filter(std::move(other.range_filter)),
+         fence_pointers(std::move(other.fence_pointers)),
+         max_key(other.max_key),
+         fd(other.fd),
+         drop_behind(other.drop_behind),
+         size(other.size),
+         max_size(other.max_size),
+         tombstones(other.tombstones),
+         oldest_tombstone(other.oldest_tombstone),
+         range_tombstones(std::move(other.range_tombstones)),
+         operand_keys(std::move(other.operand_keys)),
+         tmp_file(std::move(other.tmp_file)),
+         entries(std::move(other.entries))
+{
+    assert(other.write_buffers[0].empty() && other.write_buffers[1].empty());
 
-    mapping = nullptr;
-    mapping_fd = -1;
+    write_buffer = 0;
+    write_tokens[0] = write_tokens[1] = IO_NO_REQUEST;
+    other.fd = -1;
+    other.tmp_file.clear();
 }
 
 Run::~Run(void) {
-    assert(mapping == nullptr);
-    remove(tmp_file.c_str());
-}
-
-entry_t * Run::map_read(size_t len, off_t offset) {
-    assert(mapping == nullptr);
+    if (fd != -1) {
+        close(fd);
+    }
 
-    mapping_length = len;
+    if (!tmp_file.empty()) {
+        remove(tmp_file.c_str());
+    }
+}
 
-    mapping_fd = open(tmp_file.c_str(), O_RDONLY);
-    assert(mapping_fd != -1);
+// Prepares the run to receive its entries through put(). The file is
+// allocated up front for the expected number of entries so that it is laid
+// out contiguously. With drop_behind set, the written pages are dropped from
+// the page cache once the run is complete.
+void Run::open_write(long expected_size, bool drop_behind) {
+    assert(size == 0);
 
-    mapping = (entry_t *)mmap(0, mapping_length, PROT_READ, MAP_SHARED, mapping_fd, offset);
-    assert(mapping != MAP_FAILED);
+    this->drop_behind = drop_behind;
 
-    return mapping;
-}
+    // Not every file system supports preallocation, in which case the file
+    // simply grows as it is written
+    if (expected_size > 0) {
+        fallocate(fd, 0, 0, expected_size * sizeof(entry_t));
+    }
 
-entry_t * Run::map_read(void) {
-    map_read(max_size * sizeof(entry_t), 0);
-    return mapping;
+    write_buffer = 0;
+    write_tokens[0] = write_tokens[1] = IO_NO_REQUEST;
+    write_buffers[0].reserve(RUN_WRITE_BUFFER_PAGES * PAGE_ENTRIES);
+    write_buffers[1].reserve(RUN_WRITE_BUFFER_PAGES * PAGE_ENTRIES);
 }
 
-entry_t * Run::map_write(void) {
-    assert(mapping == nullptr);
+// Writes out any buffered entries and trims the file to the run's size
+void Run::close_write(void) {
     int result;
 
-    mapping_length = max_size * sizeof(entry_t);
+    flush_write_buffer();
+    io_queue().wait(write_tokens[0]);
+    io_queue().wait(write_tokens[1]);
 
-    mapping_fd = open(tmp_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
-    assert(mapping_fd != -1);
+    vector<entry_t>().swap(write_buffers[0]);
+    vector<entry_t>().swap(write_buffers[1]);
 
-    // Set the file to the appropriate length
-    result = lseek(mapping_fd, mapping_length - 1, SEEK_SET);
-    assert(result != -1);
-    result = write(mapping_fd, "", 1);
+    result = ftruncate(fd, size * sizeof(entry_t));
     assert(result != -1);
 
-    mapping = (entry_t *)mmap(0, mapping_length, PROT_WRITE, MAP_SHARED, mapping_fd, 0);
-    assert(mapping != MAP_FAILED);
+    if (filter == FILTER_XOR) {
+        xor_filter.build(entries.begin(), entries.end(),
+                         [](const entry_t& entry) {return entry.key;});
+    }
 
-    return mapping;
+    if (drop_behind) {
+        // Dirty pages can only be dropped once they have been written back
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE
+                                | SYNC_FILE_RANGE_WRITE
+                                | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
 }
 
-void Run::unmap(void) {
-    assert(mapping != nullptr);
+// Queues a write of the current buffer and switches to the other one so
+// that it can be refilled while the write is in flight
+void Run::flush_write_buffer(void) {
+    IOQueue& io = io_queue();
+    vector<entry_t>& buffer = write_buffers[write_buffer];
+    long first;
+
+    if (buffer.empty()) {
+        return;
+    }
+
+    // The other buffer's previous write must complete before it is reused
+    io.wait(write_tokens[1 - write_buffer]);
+
+    // Every run is written by a flush or a compaction
+    compaction_rate_limiter.request(buffer.size() * sizeof(entry_t));
 
-    munmap(mapping, mapping_length);
-    close(mapping_fd);
+    first = size - buffer.size();
+    write_tokens[write_buffer] = io.write(fd, buffer.data(), buffer.size() * sizeof(entry_t),
+                                          first * sizeof(entry_t));
+    io.submit();
 
-    mapping = nullptr;
-    mapping_length = 0;
-    mapping_fd = -1;
+    write_buffer = 1 - write_buffer;
+    write_buffers[write_buffer].clear();
 }
 
-VAL_t * Run::get(KEY_t key) {
-    vector<KEY_t>::iterator next_page;
-    long page_index;
-    VAL_t *val;
-    int i;
+// Checks whether the run's entry for the key is a merge operand
+bool Run::is_operand(KEY_t key) const {
+    return !operand_keys.empty()
+        && binary_search(operand_keys.begin(), operand_keys.end(), key);
+}
 
-    val = nullptr;
+// Checks whether the key falls within the run's fence pointer bounds
+bool Run::in_bounds(KEY_t key) const {
+    return size > 0 && key >= fence_pointers[0] && key <= max_key;
+}
 
-    if (key < fence_pointers[0] || key > max_key || !bloom_filter.is_set(key)) {
-        return val;
+// Checks the fence pointer bounds and the bloom filter without touching
+// the run's pages. A false return means the key is definitely absent.
+bool Run::may_contain(KEY_t key) const {
+    if (!in_bounds(key)) {
+        return false;
+    } else if (filter == FILTER_XOR) {
+        return xor_filter.is_set(key);
+    } else {
+        return bloom_filter.is_set(key);
     }
+}
+
+// Checks whether the inclusive range [start, end] intersects the run's
+// fence pointer bounds
+bool Run::overlaps(KEY_t start, KEY_t end) const {
+    return size > 0 && start <= max_key && end >= fence_pointers[0];
+}
+
+// Checks whether the run may hold a key in [start, end], consulting the
+// range filter over the part of the range within the run's bounds
+bool Run::may_overlap(KEY_t start, KEY_t end) const {
+    return overlaps(start, end)
+        && range_filter.may_overlap(max(start, fence_pointers[0]), min(end, max_key));
+}
+
+// Queues a read of the single page that may hold the key into page, which
+// must have room for PAGE_ENTRIES entries. Returns the number of entries
+// the page will hold once the queue has been waited on. Callers are
+// expected to have consulted may_contain() first.
+long Run::queue_lookup(KEY_t key, IOQueue& io, entry_t *page) const {
+    vector<KEY_t>::const_iterator next_page;
+    long page_index, page_size;
 
     next_page = upper_bound(fence_pointers.begin(), fence_pointers.end(), key);
     page_index = (next_page - fence_pointers.begin()) - 1;
     assert(page_index >= 0);
 
-    map_read(getpagesize(), page_index * getpagesize());
+    // The last page may only be partially filled
+    page_size = min((long)PAGE_ENTRIES, size - page_index * (long)PAGE_ENTRIES);
+
+    io.read(fd, page, page_size * sizeof(entry_t), page_index * getpagesize());
+    metric_add(METRIC_PAGES_READ);
+
+    return page_size;
+}
 
-    for (i = 0; i < getpagesize() / sizeof(entry_t); i++) {
-        if (mapping[i].key == key) {
-            val = new VAL_t;
-            *val = mapping[i].val;
+// Searches a page read by queue_lookup() for the key, storing its value in
+// val if found
+bool Run::search_page(const entry_t *page, long page_size, KEY_t key, VAL_t& val) {
+    long i;
+
+    for (i = 0; i < page_size; i++) {
+        if (page[i].key == key) {
+            val = page[i].val;
+            return true;
         }
     }
 
-    unmap();
+    return false;
+}
+
+// Reads the single page that may hold the key. The page is read into a
+// per-thread buffer so that lookups don't allocate.
+bool Run::lookup(KEY_t key, VAL_t& val) const {
+    static thread_local vector<entry_t> page;
+    IOQueue& io = io_queue();
+    long page_size;
+
+    page.resize(PAGE_ENTRIES);
+
+    page_size = queue_lookup(key, io, page.data());
+    io.wait_all();
 
-    return val;
+    return search_page(page.data(), page_size, key, val);
 }
 
-vector<entry_t> * Run::range(KEY_t start, KEY_t end) {
-    vector<entry_t> *subrange;
-    vector<KEY_t>::iterator next_page;
-    long subrange_page_start, subrange_page_end, num_pages, num_entries, i;
+bool Run::get(KEY_t key, VAL_t& val) const {
+    return may_contain(key) && lookup(key, val);
+}
 
-    subrange = new vector<entry_t>;
+// Appends the run's entries within [start, end] to the caller's vector
+void Run::range(KEY_t start, KEY_t end, vector<entry_t>& subrange) const {
+    static thread_local vector<entry_t> pages;
+    IOQueue& io = io_queue();
+    vector<KEY_t>::const_iterator next_page;
+    long subrange_page_start, subrange_page_end, num_entries, chunk, i;
 
-    // If the ranges don't overlap, return an empty vector
-    if (start > max_key || fence_pointers[0] > end) {
-        return subrange;
+    // If the ranges don't overlap, there is nothing to add
+    if (!overlaps(start, end)) {
+        return;
     }
 
     if (start < fence_pointers[0]) {
@@ -140,29 +283,62 @@ vector<entry_t> * Run::range(KEY_t start, KEY_t end) {
     }
 
     assert(subrange_page_start < subrange_page_end);
-    num_pages = subrange_page_end - subrange_page_start;
-    map_read(num_pages * getpagesize(), subrange_page_start * getpagesize());
 
-    num_entries = num_pages * getpagesize() / sizeof(entry_t);
-    subrange->reserve(num_entries);
+    // Don't read past the last entry of a partially filled final page
+    num_entries = min((subrange_page_end - subrange_page_start) * (long)PAGE_ENTRIES,
+                      size - subrange_page_start * (long)PAGE_ENTRIES);
+
+    if (num_entries > RUN_READ_AHEAD_PAGES * PAGE_ENTRIES) {
+        // Stream long scans rather than holding the whole subrange twice
+        RunReader reader(*this, subrange_page_start * PAGE_ENTRIES,
+                         subrange_page_start * PAGE_ENTRIES + num_entries, false);
+
+        do {
+            for (i = 0; i < reader.chunk_size(); i++) {
+                const entry_t& entry = reader.chunk()[i];
+                if (start <= entry.key && entry.key <= end) {
+                    subrange.push_back(entry);
+                }
+            }
+        } while (reader.next());
+
+        return;
+    }
 
-    for (i = 0; i < num_entries; i++) {
-        if (start <= mapping[i].key && mapping[i].key <= end) {
-            subrange->push_back(mapping[i]);
-        }
+    // Queue the whole subrange in chunks so that they are all in flight at
+    // once on an asynchronous queue
+    pages.resize(num_entries);
+    metric_add(METRIC_PAGES_READ, subrange_page_end - subrange_page_start);
+
+    for (i = 0; i < num_entries; i += chunk) {
+        chunk = min((long)RANGE_READ_PAGES * (long)PAGE_ENTRIES, num_entries - i);
+        io.read(fd, &pages[i], chunk * sizeof(entry_t),
+                (subrange_page_start * PAGE_ENTRIES + i) * sizeof(entry_t));
     }
 
-    unmap();
+    io.wait_all();
 
-    return subrange;
+    for (i = 0; i < num_entries; i++) {
+        if (start <= pages[i].key && pages[i].key <= end) {
+            subrange.push_back(pages[i]);
+        }
+    }
 }
 
-void Run::put(entry_t entry) {
-    assert(size < max_size);
+// Records an entry in the run's fence pointers and filters
+void Run::index(const entry_t& entry) {
+    if (filter == FILTER_BLOOM) {
+        bloom_filter.set(entry.key);
+    }
 
-    bloom_filter.set(entry.key);
+    range_filter.add(entry.key);
+
+    // Merges carry over the age of their inputs' tombstones afterwards
+    if (entry.val == VAL_TOMBSTONE && tombstones++ == 0) {
+        oldest_tombstone = time(nullptr);
+    }
 
-    if (size % getpagesize() == 0) {
+    if (size % PAGE_ENTRIES == 0) {
         fence_pointers.push_back(entry.key);
     }
 
@@ -170,12 +346,249 @@ void Run::put(entry_t entry) {
     // bound on the last page range.
     max_key = max(entry.key, max_key);
 
-    mapping[size] = entry;
+    entries.push_back(entry);
+    size++;
+}
+
+// Appends an entry to the run, marking it as a merge operand if operand is set
+void Run::put(entry_t entry, bool operand) {
+    assert(size < max_size);
 
     if (size >= max_size) {
         die("Run is full.");
     }
 
-    entries.push_back(entry);
-    size++;
+    if (operand) {
+        operand_keys.push_back(entry.key);
+    }
+
+    write_buffers[write_buffer].push_back(entry);
+    index(entry);
+
+    if (write_buffers[write_buffer].size() == RUN_WRITE_BUFFER_PAGES * PAGE_ENTRIES) {
+        flush_write_buffer();
+    }
+}
+
+/*
+ * Checkpoints
+ */
+
+// Hard-links the run's file to the given path, after making sure its
+// contents have reached the disk. Returns false with an error message if
+// either fails.
+bool Run::link_to(string path, string& error) const {
+    if (fdatasync(fd) == -1) {
+        error = "Could not sync run file: " + string(strerror(errno));
+        return false;
+    }
+
+    if (link(tmp_file.c_str(), path.c_str()) == -1) {
+        error = "Could not link '" + path + "': " + string(strerror(errno))
+            + (errno == EXDEV ? " (checkpoints must be on the same file system as "
+                                + string(TMP_FILE_PATTERN) + ")" : "");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Makes the run share the file of a checkpointed run, with the given
+ * number of entries. The file is hard-linked in place of the run's own, so
+ * the run deleting its file later leaves the checkpoint intact. The file
+ * is read once to rebuild the fence pointers and filters.
+ */
+void Run::link_from(string path, long entries_in_file) {
+    assert(size == 0);
+
+    close(fd);
+    remove(tmp_file.c_str());
+
+    if (link(path.c_str(), tmp_file.c_str()) == -1) {
+        die("Could not link '" + path + "': " + string(strerror(errno)));
+    }
+
+    fd = open(tmp_file.c_str(), O_RDONLY);
+    if (fd == -1) {
+        die("Could not open run file: " + string(strerror(errno)));
+    }
+
+    max_size = max(max_size, entries_in_file);
+    entries.reserve(entries_in_file);
+
+    RunReader reader(*this, 0, entries_in_file, true);
+
+    do {
+        for (long i = 0; i < reader.chunk_size(); i++) {
+            index(reader.chunk()[i]);
+        }
+    } while (reader.next());
+
+    if (filter == FILTER_XOR) {
+        xor_filter.build(entries.begin(), entries.end(),
+                         [](const entry_t& entry) {return entry.key;});
+    }
+}
+
+/*
+ * RunReader
+ */
+
+// Streams the entries [start, end) of the run
+RunReader::RunReader(const Run& run, long start, long end, bool background) :
+                     run(run), next_read(start), end(end), background(background)
+{
+    // Let the kernel read ahead aggressively as well
+    posix_fadvise(run.fd, start * sizeof(entry_t), (end - start) * sizeof(entry_t),
+                  POSIX_FADV_SEQUENTIAL);
+
+    current = 0;
+    read_ahead(0);
+    io_queue().wait(chunk_tokens[0]);
+    read_ahead(1);
+}
+
+RunReader::~RunReader(void) {
+    // Don't leave a read ahead in flight into memory about to be freed
+    io_queue().wait(chunk_tokens[0]);
+    io_queue().wait(chunk_tokens[1]);
+}
+
+// Queues a read of the next chunk of the run into chunks[i]
+void RunReader::read_ahead(int i) {
+    long length;
+
+    length = min((long)RUN_READ_AHEAD_PAGES * (long)PAGE_ENTRIES, end - next_read);
+
+    chunk_starts[i] = next_read;
+    chunks[i].resize(length);
+    chunk_tokens[i] = IO_NO_REQUEST;
+
+    if (length > 0) {
+        if (background) {
+            compaction_rate_limiter.request(length * sizeof(entry_t));
+        }
+
+        chunk_tokens[i] = io_queue().read(run.fd, chunks[i].data(), length * sizeof(entry_t),
+                                          next_read * sizeof(entry_t));
+        io_queue().submit();
+        metric_add(METRIC_PAGES_READ, (length + PAGE_ENTRIES - 1) / PAGE_ENTRIES);
+        next_read += length;
+    }
+}
+
+bool RunReader::next(void) {
+    if (background && chunk_size() > 0) {
+        posix_fadvise(run.fd, chunk_starts[current] * sizeof(entry_t),
+                      chunk_size() * sizeof(entry_t), POSIX_FADV_DONTNEED);
+    }
+
+    // Wait for the chunk that was read ahead, then reuse the consumed
+    // buffer to read ahead the one after it
+    current = 1 - current;
+    io_queue().wait(chunk_tokens[current]);
+    read_ahead(1 - current);
+
+    return chunk_size() > 0;
+}
+
+/*
+ * Run cursors
+ */
+
+RunCursor::RunCursor(const Run& run, KEY_t start, KEY_t end, bool reverse) :
+                     run(run), start(start), end(end), reverse(reverse)
+{
+    vector<KEY_t>::const_iterator next_page;
+
+    batch_pages = 1;
+    current = 0;
+
+    // If the ranges don't overlap, there is nothing to read
+    if (!run.overlaps(start, end)) {
+        finish();
+        return;
+    }
+
+    if (start < run.fence_pointers[0]) {
+        first_page = 0;
+    } else {
+        next_page = upper_bound(run.fence_pointers.begin(), run.fence_pointers.end(), start);
+        first_page = (next_page - run.fence_pointers.begin()) - 1;
+    }
+
+    if (end > run.max_key) {
+        last_page = run.fence_pointers.size() - 1;
+    } else {
+        next_page = upper_bound(run.fence_pointers.begin(), run.fence_pointers.end(), end);
+        last_page = (next_page - run.fence_pointers.begin()) - 1;
+    }
+}
+
+// Leaves the cursor with nothing more to read
+void RunCursor::finish(void) {
+    batch.clear();
+    current = 0;
+    first_page = 0;
+    last_page = -1;
+}
+
+// Queues the read of the next batch of pages, from the front of the pages
+// still to be read, or from their back in reverse
+void RunCursor::read(IOQueue& io) {
+    long num_pages, page, num_entries;
+
+    num_pages = min(batch_pages, last_page - first_page + 1);
+
+    if (reverse) {
+        page = last_page - num_pages + 1;
+        last_page -= num_pages;
+    } else {
+        page = first_page;
+        first_page += num_pages;
+    }
+
+    // Don't read past the last entry of a partially filled final page
+    num_entries = min(num_pages * (long)PAGE_ENTRIES, run.size - page * (long)PAGE_ENTRIES);
+
+    batch.resize(num_entries);
+    io.read(run.fd, batch.data(), num_entries * sizeof(entry_t),
+            page * PAGE_ENTRIES * sizeof(entry_t));
+    metric_add(METRIC_PAGES_READ, num_pages);
+
+    batch_pages = min(batch_pages * 2, (long)RUN_READ_AHEAD_PAGES);
+}
+
+void RunCursor::begin(IOQueue& io) {
+    current = reverse ? (long)batch.size() - 1 : 0;
+    settle(io);
+}
+
+void RunCursor::advance(IOQueue& io) {
+    current += reverse ? -1 : 1;
+    settle(io);
+}
+
+// Skips the entries of the batch that come before the range, and finishes
+// the cursor once it passes the range. Exhausted batches are replaced by
+// the next one until an entry in range is found or no pages remain.
+void RunCursor::settle(IOQueue& io) {
+    while (true) {
+        if (reverse) {
+            while (current >= 0 && batch[current].key > end) current--;
+            if (current >= 0 && batch[current].key < start) finish();
+        } else {
+            while (current < (long)batch.size() && batch[current].key < start) current++;
+            if (current < (long)batch.size() && batch[current].key > end) finish();
+        }
+
+        if (!done() || first_page > last_page) {
+            return;
+        }
+
+        read(io);
+        io.wait_all();
+        current = reverse ? (long)batch.size() - 1 : 0;
+    }
 }
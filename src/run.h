@@ -1,31 +1,137 @@
+#ifndef RUN_H
+#define RUN_H
+
+#include <ctime>
+#include <unistd.h>
 #include <vector>
 
 #include "types.h"
 #include "bloom_filter.h"
+#include "io.h"
+#include "range_filter.h"
+#include "range_tombstones.h"
+#include "xor_filter.h"
 
 #define TMP_FILE_PATTERN "/tmp/lsm-XXXXXX"
 
+// Fence pointers index the run one page of entries at a time
+#define PAGE_ENTRIES (getpagesize() / sizeof(entry_t))
+
+// Number of pages of entries buffered in memory before a run writes them
+// out. Runs fill one buffer while the other is being written.
+#define RUN_WRITE_BUFFER_PAGES 64
+
+// Number of pages a RunReader reads with a single request
+#define RUN_READ_AHEAD_PAGES 256
+
 using namespace std;
 
+// Point lookup filters a run can be built with. Bloom filters are filled in
+// as entries are put; XOR filters are built from all of the run's keys once
+// it is complete.
+enum filter_type {FILTER_BLOOM, FILTER_XOR};
+
+// Parses a filter type name, "bloom" or "xor"
+filter_type parse_filter_type(string);
+
 class Run {
+    friend class RunReader;
+    friend class RunCursor;
+    filter_type filter;
     BloomFilter bloom_filter;
+    XorFilter xor_filter;
+    RangeFilter range_filter;
     vector<KEY_t> fence_pointers;
     KEY_t max_key;
-    entry_t *mapping;
-    size_t mapping_length;
-    int mapping_fd;
-    long file_size() {return max_size * sizeof(entry_t);}
+    int fd;
+    vector<entry_t> write_buffers[2];
+    io_token write_tokens[2]; // Each buffer's write in flight, if any
+    int write_buffer;
+    bool drop_behind;
+    void flush_write_buffer(void);
+    void index(const entry_t&);
 public:
     long size, max_size;
+    long tombstones; // Number of the run's entries that are tombstones
+    time_t oldest_tombstone; // When the oldest of those tombstones was written
+    RangeTombstones range_tombstones; // Ranges deleted from older runs
+    vector<KEY_t> operand_keys; // Sorted keys whose entries are merge operands
     string tmp_file;
-    Run(long, float);
+    Run(long, float, float, filter_type);
+    Run(Run&&);
+    Run(const Run&) = delete;
     ~Run(void);
-    entry_t * map_read(size_t, off_t);
-    entry_t * map_read(void);
-    entry_t * map_write(void);
-    void unmap(void);
-    VAL_t * get(KEY_t);
-    vector<entry_t> * range(KEY_t, KEY_t);
-    void put(entry_t);
+    void open_write(long, bool);
+    void close_write(void);
+    KEY_t min_key(void) const {return fence_pointers[0];}
+    KEY_t last_key(void) const {return max_key;}
+    bool has_tombstones(void) const {return tombstones > 0 || !range_tombstones.empty();}
+    bool is_operand(KEY_t) const;
+    bool in_bounds(KEY_t) const;
+    bool may_contain(KEY_t) const;
+    bool overlaps(KEY_t, KEY_t) const;
+    bool may_overlap(KEY_t, KEY_t) const;
+    long queue_lookup(KEY_t, IOQueue&, entry_t *) const;
+    static bool search_page(const entry_t *, long, KEY_t, VAL_t&);
+    bool lookup(KEY_t, VAL_t&) const;
+    bool get(KEY_t, VAL_t&) const;
+    void range(KEY_t, KEY_t, vector<entry_t>&) const;
+    void put(entry_t, bool = false);
+    bool link_to(string, string&) const;
+    void link_from(string, long);
     vector<entry_t> entries;
 };
+
+// The RunReader class streams a run's entries from disk in large sequential
+// chunks, keeping the next chunk in flight while the current one is being
+// consumed. Background readers (compactions) are paced by the compaction
+// rate limiter, and drop the pages of each consumed chunk from the page
+// cache so that a one-off pass over the run does not evict the hot read set.
+class RunReader {
+    const Run& run;
+    long next_read, end;
+    bool background;
+    vector<entry_t> chunks[2];
+    long chunk_starts[2];
+    io_token chunk_tokens[2]; // Each chunk's read in flight, if any
+    int current;
+    void read_ahead(int);
+public:
+    RunReader(const Run&, long, long, bool);
+    ~RunReader(void);
+    // Returns the current chunk of entries, empty once the run is exhausted
+    const entry_t * chunk(void) const {return chunks[current].data();}
+    long chunk_size(void) const {return chunks[current].size();}
+    // Moves on to the next chunk, returning false if there is none
+    bool next(void);
+};
+
+// The RunCursor class walks a run's entries within a key range in
+// ascending or descending key order, for scans that may stop early. Pages
+// are read in batches that start at a single page and double each time,
+// so a scan that only needs a few entries from a run reads a page or two
+// of it, while a long one still reads in large requests.
+class RunCursor {
+    const Run& run;
+    KEY_t start, end;
+    bool reverse;
+    long first_page, last_page; // Pages still to be read, inclusive
+    long batch_pages;
+    vector<entry_t> batch;
+    long current;
+    void settle(IOQueue&);
+    void finish(void);
+public:
+    RunCursor(const Run&, KEY_t, KEY_t, bool);
+    // Queues the read of the first batch. Once the queue's requests have
+    // completed, begin() moves the cursor to the first entry in range.
+    void read(IOQueue&);
+    void begin(IOQueue&);
+    // Returns true once every entry in range has been passed
+    bool done(void) const {return current < 0 || current >= (long)batch.size();}
+    const entry_t& head(void) const {return batch[current];}
+    // Moves on to the next entry, reading the next batch if needed
+    void advance(IOQueue&);
+};
+
+#endif
@@ -0,0 +1,486 @@
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "histogram.h"
+#include "result_writer.h"
+#include "server.h"
+#include "sys.h"
+#include "write_batch.h"
+
+using namespace std;
+
+struct connection {
+    int fd;
+    string input; // Bytes received but not yet executed
+    string output; // Responses not yet written
+    size_t output_sent; // Bytes of output already written
+    uint32_t events; // Events the connection is watched for
+    bool input_closed; // Whether the client has finished sending requests
+    vector<entry_t> range_result;
+    RangeAggregate range_aggregate;
+    string value; // Value read from the value log
+    WriteBatch writes; // Puts and deletes not yet applied to the tree
+};
+
+// Applies the puts and deletes collected from a connection's requests
+static void apply_writes(ShardedLSMTree& tree, connection& conn) {
+    if (!conn.writes.empty()) {
+        tree.write(conn.writes);
+        conn.writes.clear();
+    }
+}
+
+// Parses a signed decimal number at *p, moving p past it
+static bool parse_number(const char *&p, const char *end, long& value) {
+    bool negative;
+
+    while (p < end && *p == ' ') p++;
+
+    negative = p < end && *p == '-';
+    if (negative) p++;
+
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+
+    // Saturate long numbers, which are out of range anyway
+    for (value = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (value < (1L << 40)) value = value * 10 + (*p - '0');
+    }
+
+    if (negative) value = -value;
+    return true;
+}
+
+static bool parse_key(const char *&p, const char *end, KEY_t& key) {
+    long value;
+
+    if (!parse_number(p, end, value) || value < KEY_MIN || value > KEY_MAX) {
+        return false;
+    }
+
+    key = value;
+    return true;
+}
+
+// Executes a single request line, appending its response to the output
+static void execute(ShardedLSMTree& tree, connection& conn, const char *p, const char *end) {
+    ostringstream stream;
+    KEY_t key_a, key_b;
+    VAL_t val;
+    long value;
+    string error;
+    char command;
+
+    // Tolerate the carriage returns of clients that send CRLF
+    if (end > p && end[-1] == '\r') end--;
+
+    while (p < end && *p == ' ') p++;
+
+    if (p == end) {
+        return;
+    }
+
+    command = *p++;
+
+    // Consecutive puts and deletes are collected into a single write batch,
+    // which is applied before any other request so that it sees them
+    if (command != 'p' && command != 'd') {
+        apply_writes(tree, conn);
+    }
+
+    switch (command) {
+    case 'p':
+        if (!parse_key(p, end, key_a) || !parse_number(p, end, value)) break;
+
+        if (value < VAL_MIN || value > VAL_MAX) {
+            conn.output += "error: could not insert value " + to_string(value) + ": out of range.\n";
+        } else if (tree.has_value_log()) {
+            conn.output += "error: the tree only takes values put with P.\n";
+        } else {
+            conn.writes.put(key_a, value);
+        }
+
+        return;
+    case 'm':
+        if (!parse_key(p, end, key_a) || !parse_number(p, end, value)) break;
+
+        if (value < VAL_MIN || value > VAL_MAX) {
+            conn.output += "error: could not merge value " + to_string(value) + ": out of range.\n";
+        } else if (tree.has_value_log()) {
+            conn.output += "error: the tree has a value log, which does not support merges.\n";
+        } else {
+            tree.merge(key_a, value);
+        }
+
+        return;
+    case 'g':
+        if (!parse_key(p, end, key_a)) break;
+
+        if (tree.lookup(key_a, val)) {
+            append_number(conn.output, val);
+        }
+
+        conn.output += '\n';
+        return;
+    case 'P':
+    case 'G':
+        if (!parse_key(p, end, key_a)) break;
+
+        if (!tree.has_value_log()) {
+            conn.output += "error: the tree has no value log.\n";
+        } else if (command == 'P') {
+            // The value is the rest of the line, after a single space
+            if (p < end && *p == ' ') p++;
+            conn.value.assign(p, end);
+            tree.put_blob(key_a, conn.value);
+        } else {
+            if (tree.get_blob(key_a, conn.value)) {
+                conn.output += conn.value;
+            }
+
+            conn.output += '\n';
+        }
+
+        return;
+    case 'r':
+    case 'f':
+    case 'b':
+        if (!parse_key(p, end, key_a) || !parse_key(p, end, key_b)) break;
+
+        // The first (f) or last (b) entries of a range take a limit
+        value = -1;
+        if (command != 'r' && (!parse_number(p, end, value) || value < 0)) break;
+
+        conn.range_result.clear();
+        tree.scan(key_a, key_b, value, command == 'b', conn.range_result);
+
+        append_entries(conn.output, conn.range_result.data(), conn.range_result.size());
+        conn.output += '\n';
+        return;
+    case 'a':
+        if (!parse_key(p, end, key_a) || !parse_key(p, end, key_b)) break;
+
+        conn.range_aggregate.clear();
+        tree.aggregate(key_a, key_b, conn.range_aggregate);
+        conn.range_aggregate.print(stream);
+        conn.output += stream.str();
+        return;
+    case 'd':
+        if (!parse_key(p, end, key_a)) break;
+
+        conn.writes.del(key_a);
+        return;
+    case 'D':
+        if (!parse_key(p, end, key_a) || !parse_key(p, end, key_b)) break;
+
+        tree.delete_range(key_a, key_b);
+        return;
+    case 'l':
+        // Paths are the rest of the line, in quotes
+        while (p < end && *p == ' ') p++;
+
+        if (end - p < 2 || *p != '"' || end[-1] != '"') break;
+
+        if (tree.has_value_log()) {
+            conn.output += "error: the tree only takes values put with P.\n";
+            return;
+        }
+
+        if (!tree.load(string(p + 1, end - 1))) {
+            conn.output += "error: could not locate file '" + string(p + 1, end - 1) + "'.\n";
+        }
+        return;
+    case 'c':
+        while (p < end && *p == ' ') p++;
+
+        if (end - p < 2 || *p != '"' || end[-1] != '"') break;
+
+        if (!tree.checkpoint(string(p + 1, end - 1), error)) {
+            conn.output += "error: " + error + "\n";
+        }
+        return;
+    case 's':
+        tree.printStats(stream);
+        conn.output += stream.str();
+        return;
+    case 'i':
+    case 'j':
+        tree.print_metrics(command == 'j', stream);
+        conn.output += stream.str();
+        return;
+    case 'h':
+        print_latencies(stream);
+        conn.output += stream.str();
+        return;
+    }
+
+    conn.output += "error: invalid command.\n";
+}
+
+/*
+ * Event loop
+ */
+
+// Watches the connection for writes while output is pending, and for
+// reads unless too much output is pending
+static void update_events(int epoll_fd, connection& conn) {
+    struct epoll_event event;
+    size_t pending;
+
+    pending = conn.output.size() - conn.output_sent;
+    event.events = 0;
+
+    if (pending > 0) {
+        event.events |= EPOLLOUT;
+    }
+
+    if (!conn.input_closed && pending < SERVER_MAX_PENDING_OUTPUT) {
+        event.events |= EPOLLIN | EPOLLRDHUP;
+    }
+
+    if (event.events == conn.events) {
+        return;
+    }
+
+    conn.events = event.events;
+    event.data.fd = conn.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+// Writes as much pending output as the socket takes, returning false if
+// the connection has failed
+static bool flush_output(connection& conn) {
+    ssize_t result;
+
+    while (conn.output_sent < conn.output.size()) {
+        result = send(conn.fd, conn.output.data() + conn.output_sent,
+                      conn.output.size() - conn.output_sent, MSG_NOSIGNAL);
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else if (result < 0) {
+            return false;
+        }
+
+        conn.output_sent += result;
+    }
+
+    conn.output.clear();
+    conn.output_sent = 0;
+    return true;
+}
+
+// Reads whatever the client has sent and executes every complete request,
+// returning false if the connection has failed
+static bool handle_input(ShardedLSMTree& tree, connection& conn) {
+    char buffer[SERVER_READ_SIZE];
+    size_t start, newline;
+    ssize_t result;
+
+    while (true) {
+        result = recv(conn.fd, buffer, sizeof(buffer), 0);
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (result < 0) {
+            return false;
+        } else if (result == 0) {
+            conn.input_closed = true;
+            break;
+        }
+
+        conn.input.append(buffer, result);
+
+        if (result < sizeof(buffer)) {
+            break;
+        }
+    }
+
+    // Execute the batch of complete requests, keeping any partial one
+    for (start = 0; (newline = conn.input.find('\n', start)) != string::npos; start = newline + 1) {
+        execute(tree, conn, conn.input.data() + start, conn.input.data() + newline);
+
+        if (conn.writes.size() >= SERVER_MAX_BATCH_WRITES) {
+            apply_writes(tree, conn);
+        }
+    }
+
+    apply_writes(tree, conn);
+    conn.input.erase(0, start);
+
+    return flush_output(conn);
+}
+
+static void close_connection(int epoll_fd, unordered_map<int, connection>& connections, int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    connections.erase(fd);
+}
+
+static void event_loop(ShardedLSMTree& tree, int listen_fd, int stop_fd) {
+    struct epoll_event event, events[SERVER_MAX_EVENTS];
+    unordered_map<int, connection> connections;
+    int epoll_fd, count, fd, i;
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        die("Could not create epoll instance: " + string(strerror(errno)));
+    }
+
+    // Every loop watches the listening socket, but only one is woken for
+    // each incoming connection
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    event.events = EPOLLIN;
+    event.data.fd = stop_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event);
+
+    while (true) {
+        count = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count < 0) {
+            die("epoll_wait failed: " + string(strerror(errno)));
+        }
+
+        for (i = 0; i < count; i++) {
+            fd = events[i].data.fd;
+
+            if (fd == stop_fd) {
+                for (auto& entry : connections) {
+                    close(entry.first);
+                }
+
+                close(epoll_fd);
+                return;
+            }
+
+            if (fd == listen_fd) {
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    connection& conn = connections[fd];
+                    conn.fd = fd;
+                    conn.output_sent = 0;
+                    conn.events = EPOLLIN | EPOLLRDHUP;
+                    conn.input_closed = false;
+
+                    event.events = conn.events;
+                    event.data.fd = fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+                }
+
+                continue;
+            }
+
+            connection& conn = connections[fd];
+
+            if (events[i].events & EPOLLOUT && !flush_output(conn)) {
+                close_connection(epoll_fd, connections, fd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)
+                && !conn.input_closed && !handle_input(tree, conn)) {
+                close_connection(epoll_fd, connections, fd);
+                continue;
+            }
+
+            // Close once the responses to the client's last requests are out
+            if (conn.input_closed && conn.output.empty()) {
+                close_connection(epoll_fd, connections, fd);
+                continue;
+            }
+
+            update_events(epoll_fd, conn);
+        }
+    }
+}
+
+// Returns the signals that stop the server
+static sigset_t shutdown_signals(void) {
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    return signals;
+}
+
+void block_shutdown_signals(void) {
+    sigset_t signals = shutdown_signals();
+
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+void serve(ShardedLSMTree& tree, string socket_path, int num_threads) {
+    struct sockaddr_un address;
+    vector<thread> loops;
+    sigset_t signals;
+    uint64_t one;
+    int listen_fd, stop_fd, signal;
+
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        die("Socket path '" + socket_path + "' is too long.");
+    }
+
+    // Shutdown signals are waited for synchronously, below
+    block_shutdown_signals();
+    signals = shutdown_signals();
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        die("Could not create socket: " + string(strerror(errno)));
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // Replace the socket of a previous server
+    unlink(socket_path.c_str());
+
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(listen_fd, SOMAXCONN) < 0) {
+        die("Could not listen on '" + socket_path + "': " + string(strerror(errno)));
+    }
+
+    stop_fd = eventfd(0, EFD_NONBLOCK);
+
+    for (int i = 0; i < max(num_threads, 1); i++) {
+        loops.emplace_back(event_loop, ref(tree), listen_fd, stop_fd);
+    }
+
+    sigwait(&signals, &signal);
+
+    // The event fd stays readable, so it wakes every loop
+    one = 1;
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        die("Could not stop the server: " + string(strerror(errno)));
+    }
+
+    for (auto& loop : loops) {
+        loop.join();
+    }
+
+    close(stop_fd);
+    close(listen_fd);
+    unlink(socket_path.c_str());
+}
@@ -0,0 +1,42 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+
+#include "sharded_tree.h"
+
+// Bytes read from a connection with a single call
+#define SERVER_READ_SIZE 65536
+
+// Events an event loop handles per epoll_wait call
+#define SERVER_MAX_EVENTS 64
+
+// A connection stops reading requests while this many bytes of responses
+// are waiting for the client to read them
+#define SERVER_MAX_PENDING_OUTPUT (4 << 20)
+
+// Puts and deletes of a connection applied as a single write batch at most
+#define SERVER_MAX_BATCH_WRITES 4096
+
+/*
+ * Serves the tree on a Unix domain socket until SIGINT or SIGTERM.
+ *
+ * Clients send the same commands as the command line reads from stdin, one
+ * per line, and get back what it would print: a line for each get, range,
+ * and stats command, and nothing for puts, deletes, loads and checkpoints. Requests may
+ * be pipelined. Every complete request a read returns is executed in turn,
+ * and the responses are written back together. Consecutive puts and
+ * deletes among them are applied to the tree as one write batch. Malformed requests are
+ * answered with a line starting with "error:".
+ *
+ * Each of the given number of threads runs its own epoll event loop,
+ * serving the connections it accepts.
+ */
+void serve(ShardedLSMTree&, std::string, int);
+
+// Blocks SIGINT and SIGTERM in the calling thread and the threads it goes
+// on to create, so that they are left to serve(). Must be called before the
+// tree is created, since the tree starts threads of its own.
+void block_shutdown_signals(void);
+
+#endif
@@ -0,0 +1,418 @@
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "sharded_tree.h"
+#include "sys.h"
+
+using namespace std;
+
+partitioning parse_partitioning(string name) {
+    if (name == "hash") {
+        return PARTITION_HASH;
+    } else if (name == "range") {
+        return PARTITION_RANGE;
+    }
+
+    die("Unknown partitioning '" + name + "'.");
+    return PARTITION_HASH;
+}
+
+// Creates the shards, each with the given tree parameters. The worker
+// threads are divided between the shards.
+ShardedLSMTree::ShardedLSMTree(int num_shards, partitioning scheme,
+                               int buffer_max_entries, int depth, int fanout,
+                               int num_threads, float bf_bits_per_entry,
+                               float rf_bits_per_entry, filter_type filter) :
+                               scheme(scheme)
+{
+    if (num_shards < 1) {
+        die("At least one shard is needed.");
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        shards.emplace_back(new LSMTree(buffer_max_entries, depth, fanout,
+                                        max(num_threads / num_shards, 1),
+                                        bf_bits_per_entry, rf_bits_per_entry, filter));
+    }
+}
+
+// Returns the shard a key belongs to
+int ShardedLSMTree::shard_of(KEY_t key) const {
+    uint64_t h;
+
+    if (scheme == PARTITION_RANGE) {
+        // Scale the key's offset from KEY_MIN onto [0, shards)
+        h = (uint32_t)key - (uint32_t)KEY_MIN;
+        return (h * shards.size()) >> 32;
+    }
+
+    // Mix the key (the murmur3 64-bit finalizer) so that runs of
+    // consecutive keys spread over every shard
+    h = (uint32_t)key;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+    h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h % shards.size();
+}
+
+void ShardedLSMTree::set_write_stall(int soft_runs, int hard_runs, long soft_bytes, long hard_bytes) {
+    for (auto& shard : shards) {
+        shard->set_write_stall(soft_runs, hard_runs, soft_bytes, hard_bytes);
+    }
+}
+
+void ShardedLSMTree::set_tombstone_compaction(double density, long age) {
+    for (auto& shard : shards) {
+        shard->set_tombstone_compaction(density, age);
+    }
+}
+
+void ShardedLSMTree::set_buffer_mode(buffer_mode mode) {
+    for (auto& shard : shards) {
+        shard->set_buffer_mode(mode);
+    }
+}
+
+// Splits the row cache capacity between the shards
+void ShardedLSMTree::set_row_cache(long capacity) {
+    for (auto& shard : shards) {
+        shard->set_row_cache(capacity > 0 ? max(capacity / (long)shards.size(), 1L) : 0);
+    }
+}
+
+void ShardedLSMTree::set_merge_operator(merge_operator op) {
+    for (auto& shard : shards) {
+        shard->set_merge_operator(op);
+    }
+}
+
+// Gives each shard its own value log. Logs of several shards are told
+// apart by the shard number appended to the path.
+void ShardedLSMTree::set_value_log(string path, double gc_ratio, long gc_min_bytes) {
+    if (shards.size() == 1) {
+        shards[0]->set_value_log(path, gc_ratio, gc_min_bytes);
+        return;
+    }
+
+    for (int i = 0; i < shards.size(); i++) {
+        shards[i]->set_value_log(path + "." + to_string(i + 1), gc_ratio, gc_min_bytes);
+    }
+}
+
+void ShardedLSMTree::put(KEY_t key, VAL_t val) {
+    shards[shard_of(key)]->put(key, val);
+}
+
+void ShardedLSMTree::merge(KEY_t key, VAL_t operand) {
+    shards[shard_of(key)]->merge(key, operand);
+}
+
+bool ShardedLSMTree::lookup(KEY_t key, VAL_t& val) {
+    return shards[shard_of(key)]->lookup(key, val);
+}
+
+void ShardedLSMTree::get(KEY_t key, ResultWriter& output) {
+    shards[shard_of(key)]->get(key, output);
+}
+
+void ShardedLSMTree::put_blob(KEY_t key, const string& value) {
+    shards[shard_of(key)]->put_blob(key, value);
+}
+
+bool ShardedLSMTree::get_blob(KEY_t key, string& value) {
+    return shards[shard_of(key)]->get_blob(key, value);
+}
+
+void ShardedLSMTree::del(KEY_t key) {
+    shards[shard_of(key)]->del(key);
+}
+
+// Splits a batch into one batch per shard. Each shard applies its part
+// atomically, but another client may see the parts of different shards
+// applied at different times.
+void ShardedLSMTree::write(const WriteBatch& batch) {
+    vector<WriteBatch> shard_batches;
+    int shard;
+
+    if (shards.size() == 1) {
+        shards[0]->write(batch);
+        return;
+    }
+
+    shard_batches.resize(shards.size());
+
+    for (const auto& entry : batch.entries()) {
+        shard = shard_of(entry.key);
+
+        if (entry.val == VAL_TOMBSTONE) {
+            shard_batches[shard].del(entry.key);
+        } else {
+            shard_batches[shard].put(entry.key, entry.val);
+        }
+    }
+
+    for (int i = 0; i < shards.size(); i++) {
+        shards[i]->write(shard_batches[i]);
+    }
+}
+
+// Records the range delete in every shard that may hold keys in [start, end)
+void ShardedLSMTree::delete_range(KEY_t start, KEY_t end) {
+    int first, last;
+
+    if (scheme == PARTITION_RANGE && end > start) {
+        first = shard_of(start);
+        last = shard_of(end - 1);
+    } else {
+        first = 0;
+        last = shards.size() - 1;
+    }
+
+    for (int i = first; i <= last; i++) {
+        shards[i]->delete_range(start, end);
+    }
+}
+
+/*
+ * Appends the live key-value pairs in [start, end) to the caller's vector,
+ * in key order. Range shards hold disjoint, ordered slices of the key
+ * space, so the subranges of the shards the range spans are appended in
+ * shard order. Hash shards may each hold any key in the range, so every
+ * shard is scanned; their keys are disjoint, so sorting the appended
+ * entries merges them.
+ */
+void ShardedLSMTree::scan(KEY_t start, KEY_t end, vector<entry_t>& result) {
+    long first;
+    int i;
+
+    if (shards.size() == 1) {
+        shards[0]->scan(start, end, result);
+        return;
+    }
+
+    if (scheme == PARTITION_RANGE) {
+        if (end <= start) {
+            return;
+        }
+
+        for (i = shard_of(start); i <= shard_of(end - 1); i++) {
+            shards[i]->scan(start, end, result);
+        }
+
+        return;
+    }
+
+    first = result.size();
+
+    for (auto& shard : shards) {
+        shard->scan(start, end, result);
+    }
+
+    sort(result.begin() + first, result.end());
+}
+
+/*
+ * Appends at most limit of the live key-value pairs in [start, end) to the
+ * caller's vector, in ascending or, if reverse is set, descending key
+ * order. A negative limit means no limit. Range shards are visited in scan
+ * order until the limit is reached. Hash shards are each asked for limit
+ * entries, which are then merged and cut down to the limit.
+ */
+void ShardedLSMTree::scan(KEY_t start, KEY_t end, long limit, bool reverse, vector<entry_t>& result) {
+    long first;
+    int i;
+
+    if (shards.size() == 1) {
+        shards[0]->scan(start, end, limit, reverse, result);
+        return;
+    }
+
+    first = result.size();
+
+    if (scheme == PARTITION_RANGE) {
+        if (end <= start) {
+            return;
+        }
+
+        for (i = 0; i <= shard_of(end - 1) - shard_of(start); i++) {
+            if (limit >= 0 && (long)result.size() - first >= limit) {
+                break;
+            }
+
+            shards[reverse ? shard_of(end - 1) - i : shard_of(start) + i]->scan(
+                start, end, limit < 0 ? limit : limit - ((long)result.size() - first), reverse, result);
+        }
+
+        return;
+    }
+
+    for (auto& shard : shards) {
+        shard->scan(start, end, limit, reverse, result);
+    }
+
+    if (reverse) {
+        sort(result.begin() + first, result.end(), greater<entry_t>());
+    } else {
+        sort(result.begin() + first, result.end());
+    }
+
+    if (limit >= 0 && (long)result.size() - first > limit) {
+        result.resize(first + limit);
+    }
+}
+
+// Folds the live values in [start, end) into agg. Shards hold disjoint
+// keys, so their aggregates simply combine.
+void ShardedLSMTree::aggregate(KEY_t start, KEY_t end, RangeAggregate& agg) {
+    RangeAggregate shard_agg;
+    int first, last;
+
+    if (scheme == PARTITION_RANGE && end > start) {
+        first = shard_of(start);
+        last = shard_of(end - 1);
+    } else {
+        first = 0;
+        last = shards.size() - 1;
+    }
+
+    for (int i = first; i <= last; i++) {
+        shard_agg.clear();
+        shards[i]->aggregate(start, end, shard_agg);
+        agg.add(shard_agg);
+    }
+}
+
+// The range function outputs the key-value pairs in [start, end) as a
+// single result.
+void ShardedLSMTree::range(KEY_t start, KEY_t end, ResultWriter& output) {
+    range_output.clear();
+    scan(start, end, range_output);
+    output.range(range_output);
+}
+
+// Outputs at most limit key-value pairs of [start, end), in descending key
+// order if reverse is set
+void ShardedLSMTree::range(KEY_t start, KEY_t end, long limit, bool reverse, ResultWriter& output) {
+    range_output.clear();
+    scan(start, end, limit, reverse, range_output);
+    output.range(range_output);
+}
+
+// Loads entries from a file, routing each to its shard. Returns false if
+// the file could not be opened.
+bool ShardedLSMTree::load(string file_path) {
+    ifstream stream;
+    entry_t entry;
+    WriteBatch batch;
+
+    if (shards.size() == 1) {
+        return shards[0]->load(file_path);
+    }
+
+    // Remove trailing quote from file_path, if present.
+    if (!file_path.empty() && file_path.back() == '"') {
+        file_path.pop_back();
+    }
+
+    stream.open(file_path, ifstream::binary);
+
+    if (!stream.is_open()) {
+        return false;
+    }
+
+    while (stream >> entry) {
+        batch.put(entry.key, entry.val);
+
+        if (batch.size() == LOAD_BATCH_ENTRIES) {
+            write(batch);
+            batch.clear();
+        }
+    }
+
+    write(batch);
+    return true;
+}
+
+// Checkpoints every shard into a subdirectory of dir. Each shard's
+// checkpoint is consistent, but puts from other clients may land in one
+// shard between the checkpoints of others. Returns false with an error
+// message, leaving no checkpoint behind, if any shard's fails.
+bool ShardedLSMTree::checkpoint(string dir, string& error) {
+    ostringstream manifest;
+    vector<string> created;
+    bool ok;
+
+    ok = make_checkpoint_dir(dir, created, error);
+
+    for (int i = 0; ok && i < shards.size(); i++) {
+        ok = shards[i]->checkpoint(dir + "/shard-" + to_string(i + 1), created, error);
+    }
+
+    manifest << SHARDED_CHECKPOINT_MAGIC << endl
+             << "shards " << shards.size() << endl
+             << "partitioning " << (scheme == PARTITION_RANGE ? "range" : "hash") << endl;
+
+    if (ok) {
+        ok = write_manifest(dir, manifest.str(), created, error);
+    }
+
+    if (!ok) {
+        remove_checkpoint(created);
+    }
+
+    return ok;
+}
+
+// Opens a sharded checkpoint into empty shards, which must be partitioned
+// as the checkpointed tree was
+void ShardedLSMTree::open_checkpoint(string dir) {
+    ifstream manifest;
+    string magic, shards_word, partitioning_word, name;
+    int num_shards;
+
+    manifest.open(dir + "/" + CHECKPOINT_MANIFEST);
+    if (!manifest.is_open()) {
+        die("Could not open checkpoint '" + dir + "'.");
+    }
+
+    manifest >> magic >> shards_word >> num_shards >> partitioning_word >> name;
+    if (magic != SHARDED_CHECKPOINT_MAGIC || shards_word != "shards"
+        || partitioning_word != "partitioning") {
+        die("'" + dir + "' does not hold a sharded tree checkpoint.");
+    }
+
+    if (num_shards != shards.size() || parse_partitioning(name) != scheme) {
+        die("The checkpoint has " + to_string(num_shards) + " " + name
+            + " shards, which the tree must match.");
+    }
+
+    for (int i = 0; i < shards.size(); i++) {
+        shards[i]->open_checkpoint(dir + "/shard-" + to_string(i + 1));
+    }
+}
+
+// Prints the stats of each shard in turn
+void ShardedLSMTree::printStats(ostream& out) {
+    for (int i = 0; i < shards.size(); i++) {
+        if (shards.size() > 1) {
+            out << "Shard " << i + 1 << ":" << endl;
+        }
+
+        shards[i]->printStats(out);
+    }
+}
+
+// Prints the metrics with the levels of every shard summed
+void ShardedLSMTree::print_metrics(bool json, ostream& out) {
+    vector<level_summary> summaries;
+
+    for (auto& shard : shards) {
+        shard->summarize_levels(summaries);
+    }
+
+    print_tree_metrics(json, summaries, out);
+}
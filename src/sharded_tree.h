@@ -0,0 +1,73 @@
+#ifndef SHARDED_TREE_H
+#define SHARDED_TREE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lsm_tree.h"
+#include "run.h"
+#include "types.h"
+
+#define DEFAULT_SHARD_COUNT 1
+
+// First line of a sharded checkpoint's manifest. Each shard is
+// checkpointed into its own subdirectory, shard-1 to shard-N.
+#define SHARDED_CHECKPOINT_MAGIC "lsm-sharded-checkpoint-1"
+
+// How keys are assigned to shards. Hash partitioning spreads any key
+// distribution evenly; range partitioning splits the key space into equal
+// contiguous slices, so that a range query only visits the shards it spans.
+enum partitioning {PARTITION_HASH, PARTITION_RANGE};
+
+// Parses a partitioning name, "hash" or "range"
+partitioning parse_partitioning(string);
+
+/*
+ * The ShardedLSMTree class routes each key to one of a number of
+ * independent LSM trees, each with its own buffer, levels, worker pool and
+ * compaction thread. Shards only share the process-wide metrics and the
+ * compaction rate limiter, so puts from concurrent clients to different
+ * shards never wait on one another.
+ *
+ * Point operations go to the key's shard. Range queries collect the live
+ * entries of every shard the range may touch, in key order, stopping early
+ * once a limited query has enough of them.
+ */
+class ShardedLSMTree {
+    vector<unique_ptr<LSMTree>> shards;
+    partitioning scheme;
+    vector<entry_t> range_output;
+    int shard_of(KEY_t) const;
+public:
+    ShardedLSMTree(int, partitioning, int, int, int, int, float, float, filter_type);
+    int shard_count(void) const {return shards.size();}
+    void set_write_stall(int, int, long, long);
+    void set_tombstone_compaction(double, long);
+    void set_buffer_mode(buffer_mode);
+    void set_row_cache(long);
+    void set_merge_operator(merge_operator);
+    void set_value_log(std::string, double, long);
+    bool has_value_log(void) const {return shards[0]->has_value_log();}
+    void put(KEY_t, VAL_t);
+    void write(const WriteBatch&);
+    void merge(KEY_t, VAL_t);
+    bool lookup(KEY_t, VAL_t&);
+    void get(KEY_t, ResultWriter&);
+    void put_blob(KEY_t, const std::string&);
+    bool get_blob(KEY_t, std::string&);
+    void scan(KEY_t, KEY_t, vector<entry_t>&);
+    void scan(KEY_t, KEY_t, long, bool, vector<entry_t>&);
+    void aggregate(KEY_t, KEY_t, RangeAggregate&);
+    void range(KEY_t, KEY_t, ResultWriter&);
+    void range(KEY_t, KEY_t, long, bool, ResultWriter&);
+    void del(KEY_t);
+    void delete_range(KEY_t, KEY_t);
+    bool load(std::string);
+    bool checkpoint(std::string, std::string&);
+    void open_checkpoint(std::string);
+    void printStats(ostream&);
+    void print_metrics(bool, ostream&);
+};
+
+#endif
@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "sys.h"
+#include "value_log.h"
+
+// Names of a value log's files within a checkpoint
+#define VALUE_LOG_CHECKPOINT_FILE "values.log"
+#define VALUE_LOG_CHECKPOINT_INDEX "values.index"
+
+// A live record's handle and position
+typedef pair<VAL_t, value_pointer> live_record;
+
+ValueLog::ValueLog(void) {
+    fd = -1;
+    size = 0;
+    garbage = 0;
+    gc_ratio = DEFAULT_VALUE_LOG_GC_RATIO;
+    gc_min_bytes = DEFAULT_VALUE_LOG_GC_MIN_BYTES;
+}
+
+ValueLog::~ValueLog(void) {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+void ValueLog::open(string log_path) {
+    lock_guard<mutex> guard(lock);
+
+    path = log_path;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        die("Could not create value log '" + path + "': " + string(strerror(errno)));
+    }
+
+    size = 0;
+    garbage = 0;
+    pointers.clear();
+    released.clear();
+    free_handles.clear();
+}
+
+void ValueLog::set_collection(double ratio, long min_bytes) {
+    lock_guard<mutex> guard(lock);
+
+    gc_ratio = ratio;
+    gc_min_bytes = min_bytes;
+}
+
+VAL_t ValueLog::append(KEY_t key, const string& value) {
+    lock_guard<mutex> guard(lock);
+    value_record_header header;
+    value_pointer pointer;
+    string record;
+    VAL_t handle;
+
+    if (free_handles.empty() && pointers.size() > VAL_MAX) {
+        die("The value log is out of handles.");
+    }
+
+    header.key = key;
+    header.length = value.size();
+
+    record.reserve(sizeof(header) + value.size());
+    record.append((const char *)&header, sizeof(header));
+    record.append(value);
+
+    if (pwrite(fd, record.data(), record.size(), size) != (ssize_t)record.size()) {
+        die("Could not write to value log: " + string(strerror(errno)));
+    }
+
+    pointer.offset = size;
+    pointer.length = record.size();
+    size += record.size();
+
+    if (free_handles.empty()) {
+        handle = pointers.size();
+        pointers.push_back(pointer);
+    } else {
+        handle = free_handles.back();
+        free_handles.pop_back();
+        pointers[handle] = pointer;
+    }
+
+    metric_add(METRIC_VALUE_LOG_BYTES_WRITTEN, record.size());
+
+    return handle;
+}
+
+bool ValueLog::read(KEY_t key, VAL_t handle, string& value) const {
+    lock_guard<mutex> guard(lock);
+    value_record_header header;
+    long length;
+
+    if (handle < 0 || handle >= pointers.size() || pointers[handle].offset < 0) {
+        return false;
+    }
+
+    if (pread(fd, &header, sizeof(header), pointers[handle].offset) != sizeof(header)) {
+        die("Could not read from value log: " + string(strerror(errno)));
+    }
+
+    if (header.key != key) {
+        return false;
+    }
+
+    length = pointers[handle].length - sizeof(value_record_header);
+    value.resize(length);
+
+    if (pread(fd, &value[0], length, pointers[handle].offset + sizeof(value_record_header)) != length) {
+        die("Could not read from value log: " + string(strerror(errno)));
+    }
+
+    return true;
+}
+
+void ValueLog::release(VAL_t handle) {
+    lock_guard<mutex> guard(lock);
+
+    if (handle < 0 || handle >= pointers.size() || pointers[handle].offset < 0) {
+        return;
+    }
+
+    garbage += pointers[handle].length;
+    pointers[handle].offset = -1;
+    released.push_back(handle);
+}
+
+void ValueLog::recycle(void) {
+    lock_guard<mutex> guard(lock);
+
+    free_handles.insert(free_handles.end(), released.begin(), released.end());
+    released.clear();
+}
+
+bool ValueLog::needs_collection(void) const {
+    lock_guard<mutex> guard(lock);
+
+    return fd != -1 && gc_ratio > 0 && size >= gc_min_bytes && garbage >= gc_ratio * size;
+}
+
+// Copies a number of bytes from an offset of one file to an offset of another
+static bool copy_file(int from, long from_offset, int to, long to_offset, long size) {
+    vector<char> chunk(min(size, VALUE_LOG_GC_WRITE_BYTES));
+    long offset, length;
+
+    for (offset = 0; offset < size; offset += length) {
+        length = min(size - offset, (long)chunk.size());
+
+        if (pread(from, chunk.data(), length, from_offset + offset) != length
+            || pwrite(to, chunk.data(), length, to_offset + offset) != length) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Lists the records of the live handles of a table, in the order they were
+// written in
+static void find_live_records(const vector<value_pointer>& pointers, vector<live_record>& live) {
+    for (VAL_t handle = 0; handle < pointers.size(); handle++) {
+        if (pointers[handle].offset >= 0) {
+            live.push_back(make_pair(handle, pointers[handle]));
+        }
+    }
+
+    sort(live.begin(), live.end(), [](const live_record& a, const live_record& b) {
+        return a.second.offset < b.second.offset;
+    });
+}
+
+// Copies records one after the other into a new file, reading and writing
+// both files sequentially in large chunks, and returns each record's
+// offset in the new file and the new file's size. Collections are paced
+// by the compaction rate limiter. Returns false on an I/O error.
+static bool copy_records(int from, int to, const vector<live_record>& records,
+                         vector<long>& new_offsets, long& new_size, bool rate_limited) {
+    vector<char> output;
+    long written;
+
+    new_size = 0;
+    written = 0;
+    output.reserve(VALUE_LOG_GC_WRITE_BYTES);
+
+    for (int i = 0; i < records.size(); i++) {
+        const value_pointer& pointer = records[i].second;
+
+        output.resize(output.size() + pointer.length);
+
+        if (pread(from, output.data() + output.size() - pointer.length, pointer.length,
+                  pointer.offset) != pointer.length) {
+            return false;
+        }
+
+        new_offsets.push_back(new_size);
+        new_size += pointer.length;
+
+        if (output.size() >= VALUE_LOG_GC_WRITE_BYTES || i == records.size() - 1) {
+            if (rate_limited) {
+                compaction_rate_limiter.request(output.size());
+            }
+
+            if (pwrite(to, output.data(), output.size(), written) != (ssize_t)output.size()) {
+                return false;
+            }
+
+            written += output.size();
+            output.clear();
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The log is only locked to take a snapshot of the live records and to
+ * install the new file, so that reads, appends and releases, which the
+ * tree makes with its own mutex held, are not held up by the copy and
+ * its rate limiting. Records are never changed in place, so the copy can
+ * read the old file without the lock.
+ *
+ * Once the copy is done, the records appended to the old file meanwhile
+ * are copied after it as they are, and the records released meanwhile
+ * are left behind in the new file as garbage.
+ */
+void ValueLog::collect(void) {
+    vector<live_record> live;
+    vector<long> new_offsets;
+    string tmp_path;
+    long snapshot_size, new_size, live_bytes;
+    int old_fd, new_fd;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        find_live_records(pointers, live);
+        snapshot_size = size;
+        old_fd = fd;
+    }
+
+    tmp_path = path + ".gc";
+    new_fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (new_fd == -1) {
+        die("Could not create value log '" + tmp_path + "': " + string(strerror(errno)));
+    }
+
+    if (!copy_records(old_fd, new_fd, live, new_offsets, new_size, true)) {
+        die("Could not copy value log: " + string(strerror(errno)));
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    if (!copy_file(fd, snapshot_size, new_fd, new_size, size - snapshot_size)) {
+        die("Could not write to value log: " + string(strerror(errno)));
+    }
+
+    // Records still where the snapshot found them were copied; any others
+    // were released, or appended since and copied along with the tail
+    for (int i = 0; i < live.size(); i++) {
+        if (pointers[live[i].first].offset == live[i].second.offset) {
+            pointers[live[i].first].offset = new_offsets[i];
+        }
+    }
+
+    live_bytes = 0;
+
+    for (auto& pointer : pointers) {
+        if (pointer.offset >= snapshot_size) {
+            pointer.offset += new_size - snapshot_size;
+        }
+
+        if (pointer.offset >= 0) {
+            live_bytes += pointer.length;
+        }
+    }
+
+    /*
+     * Drop the free handles at the end of the table. Those left are then
+     * handed out smallest first, so that the table's tail empties out. The
+     * handles still waiting to be recycled stop the table from shrinking
+     * past them, since a new record must not take one yet.
+     */
+    sort(free_handles.begin(), free_handles.end());
+
+    while (!free_handles.empty() && free_handles.back() == (VAL_t)pointers.size() - 1) {
+        free_handles.pop_back();
+        pointers.pop_back();
+    }
+
+    reverse(free_handles.begin(), free_handles.end());
+    pointers.shrink_to_fit();
+    free_handles.shrink_to_fit();
+
+    if (rename(tmp_path.c_str(), path.c_str()) == -1) {
+        die("Could not replace value log '" + path + "': " + string(strerror(errno)));
+    }
+
+    close(fd);
+    fd = new_fd;
+
+    new_size += size - snapshot_size;
+
+    metric_add(METRIC_VALUE_LOG_COLLECTIONS);
+    metric_add(METRIC_VALUE_LOG_BYTES_RECLAIMED, size - new_size);
+
+    size = new_size;
+    garbage = size - live_bytes;
+}
+
+// The snapshot has a descriptor of its own for the log file, which a
+// collection replacing the file leaves open, and records are never changed
+// in place, so the snapshot's records can be read without the lock
+void ValueLog::snapshot(value_log_snapshot& snapshot) const {
+    lock_guard<mutex> guard(lock);
+
+    snapshot.fd = dup(fd);
+    if (snapshot.fd == -1) {
+        die("Could not duplicate value log descriptor: " + string(strerror(errno)));
+    }
+
+    snapshot.pointers = pointers;
+}
+
+// Only the live records are copied, packed one after the other, so the
+// checkpoint holds no garbage
+bool ValueLog::copy_to(value_log_snapshot& snapshot, string dir, vector<string>& created,
+                       string& error) {
+    vector<live_record> live;
+    vector<long> new_offsets;
+    string log_path, index_path;
+    ofstream index;
+    long new_size, no_garbage;
+    int log_fd;
+    bool copied;
+
+    log_path = dir + "/" + VALUE_LOG_CHECKPOINT_FILE;
+    index_path = dir + "/" + VALUE_LOG_CHECKPOINT_INDEX;
+
+    log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (log_fd == -1) {
+        error = "Could not create '" + log_path + "': " + string(strerror(errno));
+        close(snapshot.fd);
+        return false;
+    }
+
+    created.push_back(log_path);
+
+    find_live_records(snapshot.pointers, live);
+    copied = copy_records(snapshot.fd, log_fd, live, new_offsets, new_size, false)
+        && fdatasync(log_fd) == 0;
+
+    if (!copied) {
+        error = "Could not write '" + log_path + "': " + string(strerror(errno));
+    }
+
+    close(log_fd);
+    close(snapshot.fd);
+
+    if (!copied) {
+        return false;
+    }
+
+    for (int i = 0; i < live.size(); i++) {
+        snapshot.pointers[live[i].first].offset = new_offsets[i];
+    }
+
+    no_garbage = 0;
+
+    index.open(index_path, ofstream::binary);
+    index.write((const char *)&new_size, sizeof(new_size));
+    index.write((const char *)&no_garbage, sizeof(no_garbage));
+    index.write((const char *)snapshot.pointers.data(),
+                snapshot.pointers.size() * sizeof(value_pointer));
+    index.close();
+
+    if (index.fail()) {
+        remove(index_path.c_str());
+        error = "Could not write '" + index_path + "'.";
+        return false;
+    }
+
+    created.push_back(index_path);
+    return true;
+}
+
+void ValueLog::copy_from(string dir) {
+    lock_guard<mutex> guard(lock);
+    string log_path, index_path;
+    ifstream index;
+    value_pointer pointer;
+    int log_fd;
+
+    log_path = dir + "/" + VALUE_LOG_CHECKPOINT_FILE;
+    index_path = dir + "/" + VALUE_LOG_CHECKPOINT_INDEX;
+
+    if (!pointers.empty()) {
+        die("Value logs can only be restored into an empty log.");
+    }
+
+    index.open(index_path, ifstream::binary);
+    if (!index.is_open()) {
+        die("'" + dir + "' holds no value log.");
+    }
+
+    index.read((char *)&size, sizeof(size));
+    index.read((char *)&garbage, sizeof(garbage));
+    if (!index) {
+        die("Corrupt value log index '" + index_path + "'.");
+    }
+
+    // Handles released before the checkpoint was taken are never reused:
+    // the compaction that released them may not have installed its output
+    // by then, leaving entries with them in the checkpointed runs
+    while (index.read((char *)&pointer, sizeof(pointer))) {
+        pointers.push_back(pointer);
+    }
+
+    log_fd = ::open(log_path.c_str(), O_RDONLY);
+    if (log_fd == -1) {
+        die("Could not open '" + log_path + "': " + string(strerror(errno)));
+    }
+
+    if (!copy_file(log_fd, 0, fd, 0, size)) {
+        die("Could not copy value log: " + string(strerror(errno)));
+    }
+
+    close(log_fd);
+}
+
+bool ValueLog::in_checkpoint(string dir) {
+    return access((dir + "/" + VALUE_LOG_CHECKPOINT_INDEX).c_str(), F_OK) == 0;
+}
@@ -0,0 +1,120 @@
+#ifndef VALUE_LOG_H
+#define VALUE_LOG_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+using namespace std;
+
+// A value log is collected once this share of its bytes is garbage, and it
+// holds at least the minimum number of bytes
+#define DEFAULT_VALUE_LOG_GC_RATIO 0.5
+#define DEFAULT_VALUE_LOG_GC_MIN_BYTES (64L << 20)
+
+// Number of bytes a collection copies before writing them out
+#define VALUE_LOG_GC_WRITE_BYTES (1L << 20)
+
+// Each value is stored after a header naming its key and length
+struct value_record_header {
+    KEY_t key;
+    uint32_t length;
+};
+
+// Where a handle's record lies in the log, with an offset of -1 once the
+// record is garbage
+struct value_pointer {
+    long offset;
+    uint32_t length;
+};
+
+// A copy of a log's table of handles, with a descriptor of its file at the
+// time, for copying into a checkpoint
+struct value_log_snapshot {
+    int fd;
+    vector<value_pointer> pointers;
+};
+
+/*
+ * The ValueLog class keeps values too large for the tree's entries in an
+ * append-only file, so that runs only hold each key with a small handle to
+ * its value and compactions only move those. Handles index a table of
+ * record positions held in memory, so a collection can move records
+ * without rewriting the entries that refer to them.
+ *
+ * Records become garbage when the tree releases their handles, which it
+ * does as compactions drop the entries holding them. Once enough of the
+ * log is garbage, a collection copies the live records into a new file.
+ *
+ * Released handles are handed out again to new records, so that the table
+ * only grows with the number of live values. A compaction releases the
+ * handles of the entries it drops while its input runs are still
+ * installed, so handles are only reused once the tree recycles them, after
+ * the compaction has installed its output. A reader may still race with
+ * the reuse of a handle it has just looked up, so reads check the key in
+ * the record's header.
+ */
+class ValueLog {
+    mutable mutex lock;
+    string path;
+    int fd;
+    long size, garbage;
+    double gc_ratio;
+    long gc_min_bytes;
+    vector<value_pointer> pointers;
+    vector<VAL_t> released; // Handles released since they were last recycled
+    vector<VAL_t> free_handles; // Handles new records may take
+public:
+    ValueLog(void);
+    ~ValueLog(void);
+    bool enabled(void) const {return fd != -1;}
+
+    // Creates an empty log at the path
+    void open(string);
+
+    // Sets the share of garbage and the size at which the log is collected
+    void set_collection(double, long);
+
+    // Appends a key's value, returning its handle
+    VAL_t append(KEY_t, const string&);
+
+    // Reads the value of a key's handle, returning false if it has been
+    // released, or since reused for another key
+    bool read(KEY_t, VAL_t, string&) const;
+
+    // Marks the record of a handle as garbage. Releasing a handle again
+    // has no effect.
+    void release(VAL_t);
+
+    // Lets new records take the handles released so far. The tree calls
+    // this once no run it reads from can hold an entry with one of them.
+    void recycle(void);
+
+    // Returns whether enough of the log is garbage to be collected
+    bool needs_collection(void) const;
+
+    // Copies the live records into a new log, replacing the old one, and
+    // shrinks the table of handles past the last one in use. Only one
+    // collection may run at a time.
+    void collect(void);
+
+    // Takes a snapshot of the log for a checkpoint. Only the table of
+    // handles is copied, so the tree can take it along with its runs.
+    void snapshot(value_log_snapshot&) const;
+
+    // Copies the live records of a snapshot and its table of handles into
+    // a checkpoint directory, and restores them from one into an empty log.
+    // The log is copied rather than linked, since it is appended to in place.
+    // Copying to a checkpoint closes the snapshot, records the files it
+    // creates, and returns false with an error message if it fails.
+    static bool copy_to(value_log_snapshot&, string, vector<string>&, string&);
+    void copy_from(string);
+
+    // Returns whether a checkpoint directory holds a value log
+    static bool in_checkpoint(string);
+};
+
+#endif
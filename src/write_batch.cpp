@@ -0,0 +1,23 @@
+#include <algorithm>
+
+#include "write_batch.h"
+
+void WriteBatch::sort(vector<entry_t>& sorted) const {
+    long kept;
+
+    // A stable sort leaves each key's writes in the order they were made
+    sorted.assign(writes.begin(), writes.end());
+    stable_sort(sorted.begin(), sorted.end());
+
+    kept = 0;
+
+    for (long i = 0; i < sorted.size(); i++) {
+        if (i + 1 < sorted.size() && sorted[i + 1].key == sorted[i].key) {
+            continue;
+        }
+
+        sorted[kept++] = sorted[i];
+    }
+
+    sorted.resize(kept);
+}
@@ -0,0 +1,40 @@
+#ifndef WRITE_BATCH_H
+#define WRITE_BATCH_H
+
+#include <vector>
+
+#include "types.h"
+
+using namespace std;
+
+// Batches of at least this many writes are sorted by key before being
+// applied, so that they go into the buffer in order
+#define WRITE_BATCH_SORT_MIN_ENTRIES 64
+
+/*
+ * The WriteBatch class collects puts and deletes to be applied to a tree
+ * together. The tree applies a batch that fits in its buffer under a single
+ * acquisition of its lock, so readers see either none or all of its
+ * writes, and checks whether the buffer needs flushing or writes need
+ * stalling once per batch rather than once per write. Later writes to a
+ * key override earlier ones in the same batch.
+ */
+class WriteBatch {
+    vector<entry_t> writes; // In the order they were made
+    long num_deletes;
+public:
+    WriteBatch(void) : num_deletes(0) {}
+    void put(KEY_t key, VAL_t val) {writes.push_back({key, val});}
+    void del(KEY_t key) {writes.push_back({key, VAL_TOMBSTONE}); num_deletes++;}
+    void clear(void) {writes.clear(); num_deletes = 0;}
+    bool empty(void) const {return writes.empty();}
+    long size(void) const {return writes.size();}
+    long deletes(void) const {return num_deletes;}
+    const vector<entry_t>& entries(void) const {return writes;}
+
+    // Copies the batch's writes into sorted, keeping only the last write to
+    // each key, in key order
+    void sort(vector<entry_t>& sorted) const;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include "xor_filter.h"
+
+using namespace std;
+
+static uint64_t rotl64(uint64_t n, int c) {
+    return c == 0 ? n : (n << c) | (n >> (64 - c));
+}
+
+// Maps a 32-bit hash onto [0, n) without a division
+static uint32_t reduce(uint32_t hash, uint32_t n) {
+    return (uint32_t)(((uint64_t)hash * n) >> 32);
+}
+
+static uint8_t fingerprint(uint64_t hash) {
+    return (uint8_t)(hash ^ (hash >> 32));
+}
+
+// Hashes a key with the filter's seed (the murmur3 64-bit finalizer)
+uint64_t XorFilter::hash(KEY_t key) const {
+    uint64_t h;
+
+    h = (uint64_t)(uint32_t)key + seed;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+    h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+// Returns the key's slot in the given third of the table
+uint32_t XorFilter::slot(uint64_t hash, int index) const {
+    return reduce((uint32_t)rotl64(hash, index * 21), block_length) + index * block_length;
+}
+
+/*
+ * Peels the keys off the table: a slot that only one key maps to can be
+ * assigned last, making that key's fingerprint hold whatever its other two
+ * slots end up containing. Removing the key may in turn leave one of its
+ * other slots with a single key. If every key is peeled, the fingerprints
+ * are assigned in the reverse order; otherwise the caller tries a new seed.
+ */
+bool XorFilter::try_build(const vector<uint64_t>& hashes) {
+    vector<uint32_t> counts(fingerprints.size(), 0);
+    vector<uint64_t> xors(fingerprints.size(), 0);
+    vector<uint32_t> queue;
+    vector<pair<uint64_t, uint32_t>> stack; // Peeled key hashes and their free slot
+    uint32_t s, other;
+    uint64_t h;
+    int i;
+
+    for (uint64_t hash : hashes) {
+        for (i = 0; i < 3; i++) {
+            s = slot(hash, i);
+            counts[s]++;
+            xors[s] ^= hash;
+        }
+    }
+
+    for (s = 0; s < fingerprints.size(); s++) {
+        if (counts[s] == 1) {
+            queue.push_back(s);
+        }
+    }
+
+    stack.reserve(hashes.size());
+
+    while (!queue.empty()) {
+        s = queue.back();
+        queue.pop_back();
+
+        // The slot may have lost its only key since it was queued
+        if (counts[s] != 1) {
+            continue;
+        }
+
+        // With a single key left, the XOR of the hashes is that key's hash
+        h = xors[s];
+        stack.emplace_back(h, s);
+
+        for (i = 0; i < 3; i++) {
+            other = slot(h, i);
+            counts[other]--;
+            xors[other] ^= h;
+
+            if (counts[other] == 1) {
+                queue.push_back(other);
+            }
+        }
+    }
+
+    if (stack.size() != hashes.size()) {
+        return false;
+    }
+
+    fill(fingerprints.begin(), fingerprints.end(), 0);
+
+    for (auto it = stack.rbegin(); it != stack.rend(); it++) {
+        h = it->first;
+        fingerprints[it->second] = fingerprint(h)
+                                 ^ fingerprints[slot(h, 0)]
+                                 ^ fingerprints[slot(h, 1)]
+                                 ^ fingerprints[slot(h, 2)];
+    }
+
+    return true;
+}
+
+// Check whether the key may be in the set the filter was built from
+bool XorFilter::is_set(KEY_t key) const {
+    uint64_t h;
+
+    if (block_length == 0) {
+        return true;
+    }
+
+    h = hash(key);
+
+    return fingerprint(h) == (fingerprints[slot(h, 0)]
+                            ^ fingerprints[slot(h, 1)]
+                            ^ fingerprints[slot(h, 2)]);
+}
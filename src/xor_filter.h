@@ -0,0 +1,69 @@
+#ifndef XOR_FILTER_H
+#define XOR_FILTER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "types.h"
+
+// Seeds tried before giving up on building a filter. Each attempt succeeds
+// with high probability, so this is only reached on duplicate keys.
+#define XOR_FILTER_MAX_ATTEMPTS 100
+
+// The XorFilter class is a static filter over a fixed set of keys (Graf and
+// Lemire, "Xor Filters: Faster and Smaller Than Bloom and Cuckoo Filters").
+// Each key maps to three slots, one in each third of the table, whose 8-bit
+// fingerprints XOR to the key's fingerprint. It uses about 9.8 bits per key
+// for a false positive rate of 1/256, and a lookup reads exactly three
+// bytes, but the keys must all be known when it is built.
+class XorFilter {
+    std::vector<uint8_t> fingerprints;
+    uint64_t seed;
+    uint32_t block_length;
+    uint64_t hash(KEY_t) const;
+    uint32_t slot(uint64_t, int) const;
+public:
+    XorFilter(void) : seed(0), block_length(0) {}
+    // Builds the filter from distinct keys, replacing its previous contents
+    template <typename Iterator, typename KeyOf>
+    void build(Iterator, Iterator, KeyOf);
+    void build(const std::vector<KEY_t>& keys) {
+        build(keys.begin(), keys.end(), [](KEY_t key) {return key;});
+    }
+    bool is_set(KEY_t) const;
+    long size_bytes(void) const {return fingerprints.size();}
+private:
+    bool try_build(const std::vector<uint64_t>&);
+};
+
+template <typename Iterator, typename KeyOf>
+void XorFilter::build(Iterator first, Iterator last, KeyOf key_of) {
+    std::vector<uint64_t> hashes;
+    long n;
+    int attempt;
+
+    n = last - first;
+
+    // 1.23 slots per key, plus slack that matters for small sets
+    block_length = (uint32_t)((32 + 1.23 * n) / 3);
+    fingerprints.assign(3 * block_length, 0);
+    hashes.resize(n);
+
+    for (attempt = 0; attempt < XOR_FILTER_MAX_ATTEMPTS; attempt++) {
+        seed = 0x9e3779b97f4a7c15ULL * (attempt + 1);
+
+        for (long i = 0; i < n; i++) {
+            hashes[i] = hash(key_of(first[i]));
+        }
+
+        if (try_build(hashes)) {
+            return;
+        }
+    }
+
+    // Fall back to matching every key rather than risk false negatives
+    block_length = 0;
+    fingerprints.clear();
+}
+
+#endif